@@ -1,6 +1,8 @@
 #include "client.h"
 #include "external_prod.h"
+#include "reduction.h"
 #include "seal/util/defines.h"
+#include "seal/util/rlwe.h"
 #include "seal/util/scalingvariant.h"
 #include <bitset>
 
@@ -25,8 +27,8 @@ PirClient::~PirClient() {
 
 seal::Decryptor *PirClient::get_decryptor() { return decryptor_; }
 
-GSWCiphertext PirClient::generate_gsw_from_key() {
-  GSWCiphertext gsw_enc;
+GSWMatrix PirClient::generate_gsw_from_key() {
+  GSWMatrix gsw_enc;
   auto sk_ = secret_key_->data();
   auto ntt_tables = context_->first_context_data()->small_ntt_tables();
   auto coeff_modulus = context_->first_context_data()->parms().coeff_modulus();
@@ -39,12 +41,12 @@ GSWCiphertext PirClient::generate_gsw_from_key() {
   RNSIter secret_key_iter(sk_ntt.data(), coeff_count);
   inverse_ntt_negacyclic_harvey(secret_key_iter, coeff_mod_count, ntt_tables);
 
-  key_gsw.encrypt_plain_to_gsw(sk_ntt, *encryptor_, *decryptor_, gsw_enc);
+  pir_params_.get_key_gsw().encrypt_plain_to_gsw(sk_ntt, *encryptor_, *decryptor_, gsw_enc);
   return gsw_enc;
 }
 
 size_t PirClient::get_database_plain_index(size_t entry_index) {
-  return entry_index / pir_params_.get_num_entries_per_plaintext();
+  return pir_params_.get_entry_plaintexts(entry_index).first;
 }
 
 std::vector<size_t> PirClient::get_query_indexes(size_t plaintext_index) {
@@ -62,9 +64,24 @@ std::vector<size_t> PirClient::get_query_indexes(size_t plaintext_index) {
 }
 
 PirQuery PirClient::generate_query(std::uint64_t entry_index) {
-
   // Get the corresponding index of the plaintext in the database
-  size_t plaintext_index = get_database_plain_index(entry_index);
+  return generate_plaintext_query(get_database_plain_index(entry_index));
+}
+
+PirQuery PirClient::generate_seeded_query(std::uint64_t entry_index) {
+  return generate_plaintext_query(get_database_plain_index(entry_index), true);
+}
+
+std::vector<PirQuery> PirClient::generate_entry_queries(std::uint64_t entry_index) {
+  auto [first, count] = pir_params_.get_entry_plaintexts(entry_index);
+  std::vector<PirQuery> queries;
+  for (size_t i = first; i < first + count; i++) {
+    queries.push_back(generate_plaintext_query(i));
+  }
+  return queries;
+}
+
+PirQuery PirClient::generate_plaintext_query(size_t plaintext_index, bool seeded) {
   std::vector<size_t> query_indexes = get_query_indexes(plaintext_index);
   uint64_t coeff_count = params_.poly_modulus_degree();
 
@@ -90,7 +107,16 @@ PirQuery PirClient::generate_query(std::uint64_t entry_index) {
   ptr += dims_[0];
 
   PirQuery query;
-  encryptor_->encrypt_symmetric(plain_query, query);
+  if (seeded) {
+    // What Encryptor does for a seeded encryption. Only the first polynomial
+    // is changed below, so the seed in the second one stays valid.
+    seal::util::encrypt_zero_symmetric(*secret_key_, *context_, context_->first_parms_id(), false,
+                                       true, query);
+    seal::util::multiply_add_plain_with_scaling_variant(
+        plain_query, *context_->first_context_data(), RNSIter(query.data(), coeff_count));
+  } else {
+    encryptor_->encrypt_symmetric(plain_query, query);
+  }
 
   auto l = pir_params_.get_l();
   auto base_log2 = pir_params_.get_base_log2();
@@ -99,20 +125,19 @@ PirQuery PirClient::generate_query(std::uint64_t entry_index) {
   auto coeff_modulus = context_data->parms().coeff_modulus();
   auto coeff_mod_count = coeff_modulus.size();
 
-  __uint128_t inv[coeff_mod_count];
+  // inv[k] is the inverse of bits_per_ciphertext modulo the kth modulus and
+  // pow2[k][j] is base^j, both prepared for the reduction below.
+  auto reducers = utils::make_reducers(coeff_modulus);
+  std::vector<utils::ShoupOperand> inv(coeff_mod_count);
+  std::vector<std::vector<uint64_t>> pow2(coeff_mod_count, std::vector<uint64_t>(l + 1));
   for (int k = 0; k < coeff_mod_count; k++) {
     uint64_t result;
     seal::util::try_invert_uint_mod(bits_per_ciphertext, coeff_modulus[k], result);
-    inv[k] = result;
-  }
-
-  uint128_t pow2[coeff_mod_count][l + 1];
-  for (int i = 0; i < coeff_mod_count; i++) {
-    uint128_t mod = coeff_modulus[i].value();
-    uint128_t pow = 1;
+    inv[k] = reducers[k].shoup(result);
+    uint64_t pow = 1;
     for (int j = 0; j <= l; j++) {
-      pow2[i][j] = pow;
-      pow = (pow << base_log2) % mod;
+      pow2[k][j] = pow;
+      pow = reducers[k].reduce(static_cast<uint128_t>(pow) << base_log2);
     }
   }
 
@@ -122,9 +147,7 @@ PirQuery PirClient::generate_query(std::uint64_t entry_index) {
       for (int j = 0; j < l; j++) {
         for (int k = 0; k < coeff_mod_count; k++) {
           auto pad = k * coeff_count;
-          __uint128_t mod = coeff_modulus[k].value();
-          auto coef = pow2[k][l - 1 - j] * inv[k] % mod;
-          pt[j + pad] = (pt[j + pad] + coef) % mod;
+          pt[j + pad] = reducers[k].multiply_add(pow2[k][l - 1 - j], inv[k], pt[j + pad]);
         }
       }
     }
@@ -134,7 +157,7 @@ PirQuery PirClient::generate_query(std::uint64_t entry_index) {
   return query;
 }
 
-seal::GaloisKeys PirClient::create_galois_keys() {
+std::vector<uint32_t> PirClient::get_galois_elts() const {
   std::vector<uint32_t> galois_elts = {1};
 
   // Compression factor determines how many bits there are per message (and
@@ -149,11 +172,19 @@ seal::GaloisKeys PirClient::create_galois_keys() {
   for (size_t i = min_ele; i <= params_.poly_modulus_degree() + 1; i = (i - 1) * 2 + 1) {
     galois_elts.push_back(i);
   }
+  return galois_elts;
+}
+
+seal::GaloisKeys PirClient::create_galois_keys() {
   seal::GaloisKeys galois_keys;
-  keygen_->create_galois_keys(galois_elts, galois_keys);
+  keygen_->create_galois_keys(get_galois_elts(), galois_keys);
   return galois_keys;
 }
 
+seal::Serializable<seal::GaloisKeys> PirClient::create_seeded_galois_keys() {
+  return keygen_->create_galois_keys(get_galois_elts());
+}
+
 std::vector<seal::Plaintext> PirClient::decrypt_result(std::vector<seal::Ciphertext> reply) {
   std::vector<seal::Plaintext> result(reply.size(), seal::Plaintext(params_.poly_modulus_degree()));
   for (size_t i = 0; i < reply.size(); i++) {
@@ -164,9 +195,32 @@ std::vector<seal::Plaintext> PirClient::decrypt_result(std::vector<seal::Ciphert
 }
 
 Entry PirClient::get_entry_from_plaintext(size_t entry_index, seal::Plaintext plaintext) {
-  // Offset in the plaintext in bits
-  size_t start_position_in_plaintext = (entry_index % pir_params_.get_num_entries_per_plaintext()) *
-                                       pir_params_.get_entry_size() * 8;
+  if (pir_params_.get_entry_plaintexts(entry_index).second != 1) {
+    throw std::invalid_argument("Entry spans several plaintexts");
+  }
+  return get_entry_from_plaintexts(entry_index, {plaintext});
+}
+
+Entry PirClient::get_entry_from_plaintexts(size_t entry_index,
+                                           const std::vector<seal::Plaintext> &plaintexts) {
+  auto [first_plaintext, num_plaintexts] = pir_params_.get_entry_plaintexts(entry_index);
+  if (plaintexts.size() != num_plaintexts) {
+    throw std::invalid_argument("Wrong number of plaintexts for the entry");
+  }
+
+  // The plaintexts hold consecutive parts of one bit stream.
+  size_t coeff_count = params_.poly_modulus_degree();
+  std::vector<uint64_t> coeffs(num_plaintexts * coeff_count, 0);
+  for (size_t i = 0; i < num_plaintexts; i++) {
+    std::copy_n(plaintexts[i].data(), std::min<size_t>(plaintexts[i].coeff_count(), coeff_count),
+                coeffs.data() + i * coeff_count);
+  }
+
+  // Offset in the plaintexts in bits
+  size_t start_position_in_plaintext =
+      (pir_params_.get_entry_byte_offset(entry_index) -
+       first_plaintext * pir_params_.get_num_bytes_per_plaintext()) *
+      8;
 
   // Offset in the plaintext by coefficient
   size_t num_bits_per_coeff = pir_params_.get_num_bits_per_coeff();
@@ -179,7 +233,7 @@ Entry PirClient::get_entry_from_plaintext(size_t entry_index, seal::Plaintext pl
   size_t entry_size = pir_params_.get_entry_size();
   Entry result;
 
-  uint128_t data_buffer = plaintext.data()[coeff_index] >> coeff_offset;
+  uint128_t data_buffer = coeffs[coeff_index] >> coeff_offset;
   uint128_t data_offset = num_bits_per_coeff - coeff_offset;
 
   while (result.size() < entry_size) {
@@ -189,7 +243,7 @@ Entry PirClient::get_entry_from_plaintext(size_t entry_index, seal::Plaintext pl
       data_offset -= 8;
     } else {
       coeff_index += 1;
-      uint128_t next_buffer = plaintext.data()[coeff_index];
+      uint128_t next_buffer = coeffs[coeff_index];
       data_buffer |= next_buffer << data_offset;
       data_offset += num_bits_per_coeff;
     }
@@ -0,0 +1,14 @@
+#include "executor.h"
+#include <algorithm>
+
+QueryExecutor::QueryExecutor(PirServer &server, size_t max_concurrent)
+    : server_(server), requests_(std::max<size_t>(max_concurrent, 1) + 1) {}
+
+std::future<std::vector<seal::Ciphertext>> QueryExecutor::submit(uint32_t client_id,
+                                                                 PirQuery query) {
+  return requests_.submit([this, client_id, query = std::move(query)]() mutable {
+    return server_.make_query(client_id, std::move(query));
+  });
+}
+
+size_t QueryExecutor::max_concurrent() const { return requests_.size() - 1; }
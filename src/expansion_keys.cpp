@@ -0,0 +1,186 @@
+#include "expansion_keys.h"
+#include "reduction.h"
+#include "workspace.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace {
+// out = in(x^galois_elt) modulo x^n + 1 and q, for a polynomial in coefficient
+// form. Coefficient i goes to i * galois_elt mod 2n, negated when that is n or
+// more.
+void apply_automorphism(const uint64_t *in, size_t n, uint32_t galois_elt, uint64_t q,
+                        uint64_t *out) {
+  uint64_t index_raw = 0;
+  for (size_t i = 0; i < n; i++, index_raw += galois_elt) {
+    uint64_t value = in[i];
+    out[index_raw & (n - 1)] = (index_raw & n) && value != 0 ? q - value : value;
+  }
+}
+} // namespace
+
+ExpansionKeys::ExpansionKeys(std::shared_ptr<const seal::SEALContext> context,
+                             const seal::GaloisKeys &keys,
+                             const std::vector<uint32_t> &galois_elts)
+    : context_(std::move(context)), galois_elts_(galois_elts) {
+  auto &key_parms = context_->key_context_data()->parms();
+  coeff_count_ = key_parms.poly_modulus_degree();
+  decomp_mod_count_ = context_->first_context_data()->parms().coeff_modulus().size();
+  size_t special = key_parms.coeff_modulus().size() - 1;
+  data_.resize(galois_elts_.size() * words_per_elt());
+
+  for (size_t e = 0; e < galois_elts_.size(); e++) {
+    if (!keys.has_key(galois_elts_[e])) {
+      throw std::invalid_argument("No Galois key for element " +
+                                  std::to_string(galois_elts_[e]));
+    }
+    auto &key_vector = keys.key(galois_elts_[e]);
+    for (size_t i = 0; i <= decomp_mod_count_; i++) {
+      size_t key_index = i == decomp_mod_count_ ? special : i;
+      for (size_t j = 0; j < decomp_mod_count_; j++) {
+        for (size_t k = 0; k < 2; k++) {
+          const uint64_t *poly = key_vector[j].data().data(k) + key_index * coeff_count_;
+          std::copy_n(poly, coeff_count_, data_.data() + key_offset(e, i, j, k));
+        }
+      }
+    }
+  }
+}
+
+ExpansionKeys::ExpansionKeys(std::shared_ptr<const seal::SEALContext> context,
+                             std::vector<uint32_t> galois_elts, const uint64_t *data, size_t size)
+    : context_(std::move(context)), galois_elts_(std::move(galois_elts)) {
+  coeff_count_ = context_->key_context_data()->parms().poly_modulus_degree();
+  decomp_mod_count_ = context_->first_context_data()->parms().coeff_modulus().size();
+  if (size != galois_elts_.size() * words_per_elt()) {
+    throw std::invalid_argument("Expansion keys do not match the encryption parameters");
+  }
+  data_.assign(data, data + size);
+}
+
+bool ExpansionKeys::has_key(uint32_t galois_elt) const {
+  return std::find(galois_elts_.begin(), galois_elts_.end(), galois_elt) != galois_elts_.end();
+}
+
+// The same steps as seal::Evaluator::switch_key_inplace for BFV: the rotated
+// c1 is decomposed into its limbs, each limb is taken to every key modulus and
+// multiplied by the key in NTT form, and the products are divided by the
+// special prime with rounding. The products of the digits are summed in 128
+// bits and reduced once per modulus.
+void ExpansionKeys::apply_galois(const seal::Ciphertext &encrypted, uint32_t galois_elt,
+                                 seal::Ciphertext &destination) const {
+  auto found = std::find(galois_elts_.begin(), galois_elts_.end(), galois_elt);
+  if (found == galois_elts_.end()) {
+    throw std::invalid_argument("No expansion key for Galois element " +
+                                std::to_string(galois_elt));
+  }
+  if (encrypted.size() != 2 || encrypted.is_ntt_form() ||
+      encrypted.parms_id() != context_->first_parms_id()) {
+    throw std::invalid_argument("Expansion keys need a ciphertext of size 2 in coefficient "
+                                "form at the first level");
+  }
+  size_t elt_index = found - galois_elts_.begin();
+  const size_t n = coeff_count_;
+  const size_t limbs = decomp_mod_count_;
+  auto &key_context = *context_->key_context_data();
+  auto &key_modulus = key_context.parms().coeff_modulus();
+  auto key_ntt_tables = key_context.small_ntt_tables();
+  auto inv_special_mod_q = key_context.rns_tool()->inv_q_last_mod_q();
+  const size_t special = key_modulus.size() - 1;
+
+  QueryWorkspace &workspace = QueryWorkspace::local();
+  QueryWorkspace::Scope scope(workspace);
+  uint64_t *rotated = workspace.allocate<uint64_t>(2 * limbs * n);
+  uint64_t *operand = workspace.allocate<uint64_t>(n);
+  uint128_t *acc = workspace.allocate<uint128_t>(2 * n);
+  // Product k for key modulus i at (k * (limbs + 1) + i) * n.
+  uint64_t *prod = workspace.allocate<uint64_t>(2 * (limbs + 1) * n);
+
+  for (size_t k = 0; k < 2; k++) {
+    for (size_t j = 0; j < limbs; j++) {
+      apply_automorphism(encrypted.data(k) + j * n, n, galois_elt, key_modulus[j].value(),
+                         rotated + (k * limbs + j) * n);
+    }
+  }
+  const uint64_t *target = rotated + limbs * n;
+
+  for (size_t i = 0; i <= limbs; i++) {
+    size_t key_index = i == limbs ? special : i;
+    const seal::Modulus &modulus = key_modulus[key_index];
+    std::fill_n(acc, 2 * n, 0);
+    for (size_t j = 0; j < limbs; j++) {
+      const uint64_t *limb = target + j * n;
+      if (key_modulus[j].value() <= modulus.value()) {
+        std::copy_n(limb, n, operand);
+      } else {
+        for (size_t c = 0; c < n; c++) {
+          operand[c] = seal::util::barrett_reduce_64(limb[c], modulus);
+        }
+      }
+      // Lazy NTT output is below 4q, so each product is below 4q^2 and, with
+      // SEAL's moduli of at most 60 bits, the sums cannot overflow.
+      seal::util::ntt_negacyclic_harvey_lazy(seal::util::CoeffIter(operand),
+                                             key_ntt_tables[key_index]);
+      const uint64_t *key0 = data_.data() + key_offset(elt_index, i, j, 0);
+      const uint64_t *key1 = data_.data() + key_offset(elt_index, i, j, 1);
+      for (size_t c = 0; c < n; c++) {
+        acc[c] += static_cast<uint128_t>(operand[c]) * key0[c];
+        acc[n + c] += static_cast<uint128_t>(operand[c]) * key1[c];
+      }
+    }
+    utils::Reducer reducer(modulus);
+    reducer.reduce(acc, n, prod + i * n);
+    reducer.reduce(acc + n, n, prod + (limbs + 1 + i) * n);
+  }
+
+  if (&destination != &encrypted) {
+    destination.resize(*context_, encrypted.parms_id(), 2);
+    destination.is_ntt_form() = false;
+  }
+  const seal::Modulus &special_modulus = key_modulus[special];
+  const uint64_t special_half = special_modulus.value() >> 1;
+  for (size_t k = 0; k < 2; k++) {
+    uint64_t *prod_k = prod + k * (limbs + 1) * n;
+    uint64_t *last = prod_k + limbs * n;
+    seal::util::inverse_ntt_negacyclic_harvey_lazy(seal::util::CoeffIter(last),
+                                                   key_ntt_tables[special]);
+    // Adding half the special prime turns the division below into rounding.
+    for (size_t c = 0; c < n; c++) {
+      last[c] = seal::util::barrett_reduce_64(last[c] + special_half, special_modulus);
+    }
+    for (size_t j = 0; j < limbs; j++) {
+      const seal::Modulus &modulus = key_modulus[j];
+      const uint64_t q = modulus.value();
+      const uint64_t fix = q - seal::util::barrett_reduce_64(special_half, modulus);
+      const bool reduce_last = special_modulus.value() > q;
+      utils::Reducer reducer(modulus);
+      utils::ShoupOperand inv_special = reducer.shoup(inv_special_mod_q[j].operand);
+      uint64_t *part = prod_k + j * n;
+      seal::util::inverse_ntt_negacyclic_harvey_lazy(seal::util::CoeffIter(part),
+                                                     key_ntt_tables[j]);
+      const uint64_t *base = rotated + j * n;
+      uint64_t *out = destination.data(k) + j * n;
+      for (size_t c = 0; c < n; c++) {
+        // part is below 2q after the lazy inverse NTT and t below 2q, so the
+        // difference is positive.
+        uint64_t t = reduce_last ? seal::util::barrett_reduce_64(last[c], modulus) : last[c];
+        t += fix;
+        uint64_t r = reducer.multiply(part[c] + 2 * q - t, inv_special);
+        if (k == 0) {
+          r += base[c];
+          r = r >= q ? r - q : r;
+        }
+        out[c] = r;
+      }
+    }
+  }
+}
+
+size_t ExpansionKeys::key_offset(size_t elt_index, size_t i, size_t j, size_t k) const {
+  return elt_index * words_per_elt() + ((i * decomp_mod_count_ + j) * 2 + k) * coeff_count_;
+}
+
+size_t ExpansionKeys::words_per_elt() const {
+  return (decomp_mod_count_ + 1) * decomp_mod_count_ * 2 * coeff_count_;
+}
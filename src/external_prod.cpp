@@ -1,18 +1,24 @@
 #include "external_prod.h"
+#include "database_constants.h"
+#include "reduction.h"
 #include "seal/util/polyarithsmallmod.h"
 #include "utils.h"
+#include "workspace.h"
+#include <algorithm>
 #include <cassert>
 
 // Here we compute a cross product between the transpose of the decomposed BFV
 // (a 2l vector of polynomials) and the GSW ciphertext (a 2lx2 matrix of
 // polynomials) to obtain a size-2 vector of polynomials, which is exactly our
 // result ciphertext. We use an NTT multiplication to speed up polynomial
-// multiplication, assuming that both the GSWCiphertext and decomposed bfv is in
+// multiplication, assuming that both the GSW ciphertext and decomposed bfv is in
 // polynomial coefficient representation.
 
-GSWEval data_gsw, key_gsw;
+void GSWEval::gsw_ntt_negacyclic_harvey(GSWMatrix &gsw) const {
+  gsw_ntt_negacyclic_harvey(gsw, 0, gsw.rows());
+}
 
-void GSWEval::gsw_ntt_negacyclic_harvey(GSWCiphertext &gsw) {
+void GSWEval::gsw_ntt_negacyclic_harvey(GSWMatrix &gsw, size_t row_begin, size_t row_end) const {
   const auto &context_data = context->first_context_data();
   auto &parms2 = context_data->parms();
   auto &coeff_modulus = parms2.coeff_modulus();
@@ -20,19 +26,17 @@ void GSWEval::gsw_ntt_negacyclic_harvey(GSWCiphertext &gsw) {
   size_t coeff_mod_count = coeff_modulus.size();
   auto ntt_tables = context_data->small_ntt_tables();
 
-  for (auto &poly : gsw) {
-    seal::util::CoeffIter gsw_poly_ptr(poly.data());
-    for (int i = 0; i < coeff_mod_count; i++) {
-      seal::util::ntt_negacyclic_harvey(gsw_poly_ptr + coeff_count * i, *(ntt_tables + i));
-    }
-    seal::util::CoeffIter gsw_poly_ptr2(poly.data() + coeff_count * coeff_mod_count);
-    for (int i = 0; i < coeff_mod_count; i++) {
-      seal::util::ntt_negacyclic_harvey(gsw_poly_ptr2 + coeff_count * i, *(ntt_tables + i));
+  for (size_t row = row_begin; row < row_end; row++) {
+    for (size_t col = 0; col < 2; col++) {
+      seal::util::CoeffIter gsw_poly_ptr(gsw.poly(row, col));
+      for (int i = 0; i < coeff_mod_count; i++) {
+        seal::util::ntt_negacyclic_harvey(gsw_poly_ptr + coeff_count * i, *(ntt_tables + i));
+      }
     }
   }
 }
 
-void GSWEval::cyphertext_inverse_ntt(seal::Ciphertext &ct) {
+void GSWEval::cyphertext_inverse_ntt(seal::Ciphertext &ct) const {
   const auto &context_data = context->first_context_data();
   auto &parms2 = context_data->parms();
   auto &coeff_modulus = parms2.coeff_modulus();
@@ -48,62 +52,92 @@ void GSWEval::cyphertext_inverse_ntt(seal::Ciphertext &ct) {
   }
 }
 
-void GSWEval::external_product(GSWCiphertext const &gsw_enc, seal::Ciphertext const &bfv,
-                               size_t ct_poly_size, seal::Ciphertext &res_ct) {
+void GSWEval::external_product(GSWMatrix const &gsw_enc, seal::Ciphertext const &bfv,
+                               size_t ct_poly_size, seal::Ciphertext &res_ct) const {
+  if (&res_ct != &bfv) {
+    res_ct = bfv;
+  }
+  external_product_batch(gsw_enc, &res_ct, 1);
+}
 
+// The batch is processed in chunks of DatabaseConstants::ExternalProductBatch
+// ciphertexts. A chunk is decomposed and transformed to NTT form up front,
+// then the products are accumulated one block of TileCoeffs coefficients at a
+// time: the block of every GSW entry is loaded once and used for each
+// ciphertext of the chunk while it is in cache.
+void GSWEval::external_product_batch(GSWMatrix const &gsw_enc, seal::Ciphertext *cts,
+                                     size_t count, ThreadPool *pool) const {
+  const size_t tile = DatabaseConstants::TileCoeffs;
+  const size_t batch = DatabaseConstants::ExternalProductBatch;
   const auto &context_data = context->first_context_data();
   auto &parms2 = context_data->parms();
   auto &coeff_modulus = parms2.coeff_modulus();
   size_t coeff_count = parms2.poly_modulus_degree();
   size_t coeff_mod_count = coeff_modulus.size();
   auto ntt_tables = context_data->small_ntt_tables();
-
-  std::vector<std::vector<uint64_t>> decomposed_bfv;
-  decomp_rlwe(bfv, decomposed_bfv);
-
-  for (auto &poly : decomposed_bfv) {
-    seal::util::CoeffIter bfv_poly_ptr(poly);
-    for (int i = 0; i < coeff_mod_count; i++) {
-      seal::util::ntt_negacyclic_harvey(bfv_poly_ptr + coeff_count * i, *(ntt_tables + i));
+  size_t poly_size = coeff_count * coeff_mod_count;
+  size_t rows = 2 * l;
+  size_t num_blocks = poly_size / tile;
+  auto multiply_poly_acum = utils::multiply_poly_acum_kernel(utils::max_bit_count(coeff_modulus));
+  auto reducers = utils::make_reducers(coeff_modulus);
+
+  auto parallel_for = [pool](size_t begin, size_t end, const std::function<void(size_t)> &fn) {
+    if (pool != nullptr) {
+      pool->parallel_for(begin, end, fn);
+      return;
     }
-  }
-
-  std::vector<std::vector<uint128_t>> result(
-      2, std::vector<uint128_t>(coeff_count * coeff_mod_count, 0));
-
-  for (int k = 0; k < 2; ++k) {
-    for (size_t j = 0; j < 2 * l; j++) {
-      seal::util::ConstCoeffIter encrypted_gsw_ptr(gsw_enc[j].data() +
-                                                   k * coeff_count * coeff_mod_count);
-      seal::util::ConstCoeffIter encrypted_rlwe_ptr(decomposed_bfv[j]);
-      utils::multiply_poly_acum(encrypted_rlwe_ptr, encrypted_gsw_ptr,
-                                coeff_count * coeff_mod_count, result[k].data());
+    for (size_t i = begin; i < end; i++) {
+      fn(i);
     }
-  }
-
-  for (size_t poly_id = 0; poly_id < 2; poly_id++) {
-    auto ct_ptr = res_ct.data(poly_id);
-    auto pt_ptr = result[poly_id];
-
-    for (int mod_id = 0; mod_id < coeff_mod_count; mod_id++) {
-      auto mod_idx = (mod_id * coeff_count);
-      auto mod = static_cast<uint64_t>(coeff_modulus[mod_id].value());
-      for (int coeff_id = 0; coeff_id < coeff_count; coeff_id++) {
-        ct_ptr[coeff_id + mod_idx] = static_cast<uint64_t>(pt_ptr[coeff_id + mod_idx] % mod);
+  };
+
+  // Decomposed rows come from the caller's workspace and are reused from one
+  // chunk to the next; ciphertext c of a chunk starts at row c * rows.
+  QueryWorkspace &workspace = QueryWorkspace::local();
+  QueryWorkspace::Scope scope(workspace);
+  uint64_t *decomposed = workspace.allocate<uint64_t>(std::min(count, batch) * rows * poly_size);
+
+  for (size_t chunk_begin = 0; chunk_begin < count; chunk_begin += batch) {
+    size_t chunk = std::min(batch, count - chunk_begin);
+    seal::Ciphertext *chunk_cts = cts + chunk_begin;
+
+    parallel_for(0, chunk, [&](size_t c) {
+      decomp_rlwe(chunk_cts[c], decomposed + c * rows * poly_size);
+    });
+    parallel_for(0, chunk * rows, [&](size_t task_id) {
+      seal::util::CoeffIter bfv_poly_ptr(decomposed + task_id * poly_size);
+      for (int i = 0; i < coeff_mod_count; i++) {
+        seal::util::ntt_negacyclic_harvey(bfv_poly_ptr + coeff_count * i, *(ntt_tables + i));
       }
-    }
+    });
+
+    parallel_for(0, num_blocks, [&](size_t block_id) {
+      size_t offset = block_id * tile;
+      const utils::Reducer &reducer = reducers[offset / coeff_count];
+      QueryWorkspace &block_workspace = QueryWorkspace::local();
+      QueryWorkspace::Scope block_scope(block_workspace);
+      uint128_t *buffer = block_workspace.allocate<uint128_t>(tile);
+      for (size_t c = 0; c < chunk; c++) {
+        const uint64_t *ct_rows = decomposed + c * rows * poly_size;
+        for (size_t k = 0; k < 2; k++) {
+          std::fill_n(buffer, tile, 0);
+          for (size_t j = 0; j < rows; j++) {
+            multiply_poly_acum(ct_rows + j * poly_size + offset, gsw_enc.poly(j, k) + offset, tile,
+                               buffer);
+          }
+          reducer.reduce(buffer, tile, chunk_cts[c].data(k) + offset);
+        }
+      }
+    });
   }
 }
 
-void GSWEval::decomp_rlwe(seal::Ciphertext const &ct, std::vector<std::vector<uint64_t>> &output) {
-
-  assert(output.size() == 0);
-  output.reserve(2 * l);
-
-  // Get parameters
-  const uint128_t base = uint128_t(1) << base_log2;
-  const uint128_t mask = base - 1;
-
+// Each polynomial is composed to multi-precision once, then all l digits of a
+// coefficient are read straight out of its words in one pass. A digit is
+// smaller than the base, so when the base is below every coefficient modulus
+// its RNS form is the digit itself in every limb and no decomposition back to
+// RNS is needed; that case runs the extract_digits kernel of kernel_set.
+void GSWEval::decomp_rlwe(seal::Ciphertext const &ct, uint64_t *output) const {
   const auto &context_data = context->first_context_data();
   auto &parms = context_data->parms();
   auto &coeff_modulus = parms.coeff_modulus();
@@ -111,91 +145,140 @@ void GSWEval::decomp_rlwe(seal::Ciphertext const &ct, std::vector<std::vector<ui
   size_t coeff_mod_count = coeff_modulus.size();
   size_t ct_poly_count = ct.size();
   assert(ct_poly_count == 2);
+  assert(base_log2 > 0 && base_log2 <= 64);
+
+  const uint64_t mask = base_log2 == 64 ? ~uint64_t(0) : (uint64_t(1) << base_log2) - 1;
+  bool reduce_digits = false;
+  for (auto &mod : coeff_modulus) {
+    reduce_digits |= mod.bit_count() <= static_cast<int>(base_log2);
+  }
 
   seal::util::RNSBase *rns_base = context_data->rns_tool()->base_q();
   auto pool = seal::MemoryManager::GetPool();
 
-  std::vector<uint64_t> data(coeff_count * coeff_mod_count);
-
-  for (int j = 0; j < ct_poly_count; j++) {
-    const uint64_t *poly_ptr = ct.data(j);
-
-    memcpy(data.data(), poly_ptr, coeff_count * coeff_mod_count * sizeof(uint64_t));
-    rns_base->compose_array(data.data(), coeff_count, pool);
-
-    for (int p = l - 1; p >= 0; p--) {
-      std::vector<uint64_t> row = data;
-      const int shift_amount = p * base_log2;
-
-      for (size_t k = 0; k < coeff_count; k++) {
-        auto ptr = row.data() + k * coeff_mod_count;
-        seal::util::right_shift_uint(ptr, shift_amount, coeff_mod_count, ptr);
-        ptr[0] &= mask;
-        for (int i = 1; i < coeff_mod_count; i++) {
-          ptr[i] = 0;
+  size_t poly_size = coeff_count * coeff_mod_count;
+  QueryWorkspace &workspace = QueryWorkspace::local();
+  QueryWorkspace::Scope scope(workspace);
+  uint64_t *data = workspace.allocate<uint64_t>(poly_size);
+  uint64_t *digits = workspace.allocate<uint64_t>(l);
+
+  for (size_t j = 0; j < ct_poly_count; j++) {
+    std::copy_n(ct.data(j), poly_size, data);
+    rns_base->compose_array(data, coeff_count, pool);
+    // Row j * l + r holds digit l - 1 - r, most significant first.
+    uint64_t *rows = output + j * l * poly_size;
+
+    if (!reduce_digits) {
+      kernel_set->extract_digits(data, coeff_count, coeff_mod_count, l, base_log2, rows);
+      continue;
+    }
+    for (size_t k = 0; k < coeff_count; k++) {
+      const uint64_t *value = data + k * coeff_mod_count;
+      for (size_t p = 0; p < l; p++) {
+        size_t bit = p * base_log2;
+        size_t word = bit / 64;
+        size_t shift = bit % 64;
+        uint64_t digit = 0;
+        if (word < coeff_mod_count) {
+          digit = value[word] >> shift;
+          if (shift != 0 && shift + base_log2 > 64 && word + 1 < coeff_mod_count) {
+            digit |= value[word + 1] << (64 - shift);
+          }
+        }
+        digits[p] = digit & mask;
+      }
+      for (size_t r = 0; r < l; r++) {
+        uint64_t digit = digits[l - 1 - r];
+        for (size_t i = 0; i < coeff_mod_count; i++) {
+          rows[r * poly_size + k + i * coeff_count] =
+              seal::util::barrett_reduce_64(digit, coeff_modulus[i]);
         }
       }
-
-      rns_base->decompose_array(row.data(), coeff_count, pool);
-
-      output.push_back(std::move(row));
     }
   }
-  // std::cout << "SIZE " << output.size() << std::endl;
 }
 
-void GSWEval::query_to_gsw(std::vector<seal::Ciphertext> query, GSWCiphertext gsw_key,
-                           GSWCiphertext &output) {
-  int cl = query.size();
-  assert(output.size() == 0);
-  output.resize(cl);
+void GSWEval::decomp_rlwe(seal::Ciphertext const &ct,
+                          std::vector<std::vector<uint64_t>> &output) const {
+  size_t poly_size = context->first_context_data()->parms().poly_modulus_degree() *
+                     context->first_context_data()->parms().coeff_modulus().size();
+  QueryWorkspace &workspace = QueryWorkspace::local();
+  QueryWorkspace::Scope scope(workspace);
+  uint64_t *rows = workspace.allocate<uint64_t>(ct.size() * l * poly_size);
+  decomp_rlwe(ct, rows);
+  output.resize(ct.size() * l);
+  for (size_t r = 0; r < output.size(); r++) {
+    output[r].assign(rows + r * poly_size, rows + (r + 1) * poly_size);
+  }
+}
+
+void GSWEval::query_to_gsw(const seal::Ciphertext *query, size_t cl, const GSWMatrix &gsw_key,
+                           GSWMatrix &output) const {
+  queries_to_gsw(query, cl, 1, gsw_key, &output);
+}
 
+// Every selector multiplies its query ciphertexts by the same key, so the
+// count * cl external products run as one batch.
+void GSWEval::queries_to_gsw(const seal::Ciphertext *query, size_t cl, size_t count,
+                             const GSWMatrix &gsw_key, GSWMatrix *output,
+                             ThreadPool *pool) const {
+  if (count == 0) {
+    return;
+  }
   const auto &context_data = context->get_context_data(query[0].parms_id());
   auto &parms = context_data->parms();
-  auto &coeff_modulus = parms.coeff_modulus();
   size_t coeff_count = parms.poly_modulus_degree();
-  size_t coeff_mod_count = coeff_modulus.size();
+  size_t coeff_mod_count = parms.coeff_modulus().size();
+  size_t poly_size = coeff_count * coeff_mod_count;
 
-  for (int i = 0; i < cl; i++) {
-    for (int j = 0; j < coeff_count * coeff_mod_count; j++) {
-      output[i].push_back(query[i].data(0)[j]);
-    }
-    for (int j = 0; j < coeff_count * coeff_mod_count; j++) {
-      output[i].push_back(query[i].data(1)[j]);
-    }
+  // The external product leaves its result in NTT form.
+  std::vector<seal::Ciphertext> products(query, query + count * cl);
+  external_product_batch(gsw_key, products.data(), products.size(), pool);
+
+  for (size_t s = 0; s < count; s++) {
+    output[s].resize(2 * cl, poly_size);
   }
-  gsw_ntt_negacyclic_harvey(output);
-  output.resize(2 * cl);
-  for (int i = 0; i < cl; i++) {
-    external_product(gsw_key, query[i], coeff_count, query[i]);
-    for (int j = 0; j < coeff_count * coeff_mod_count; j++) {
-      output[i + cl].push_back(query[i].data(0)[j]);
-    }
-    for (int j = 0; j < coeff_count * coeff_mod_count; j++) {
-      output[i + cl].push_back(query[i].data(1)[j]);
+  auto fill_row = [&](size_t index) {
+    GSWMatrix &gsw = output[index / cl];
+    size_t i = index % cl;
+    std::copy_n(query[index].data(0), poly_size, gsw.poly(i, 0));
+    std::copy_n(query[index].data(1), poly_size, gsw.poly(i, 1));
+    gsw_ntt_negacyclic_harvey(gsw, i, i + 1);
+    std::copy_n(products[index].data(0), poly_size, gsw.poly(i + cl, 0));
+    std::copy_n(products[index].data(1), poly_size, gsw.poly(i + cl, 1));
+  };
+  if (pool) {
+    pool->parallel_for(0, count * cl, fill_row);
+  } else {
+    for (size_t index = 0; index < count * cl; index++) {
+      fill_row(index);
     }
   }
 }
 
 void GSWEval::encrypt_plain_to_gsw(std::vector<uint64_t> const &plaintext,
                                    seal::Encryptor const &encryptor, seal::Decryptor &decryptor,
-                                   GSWCiphertext &output) {
+                                   GSWMatrix &output) const {
   const auto &context_data = context->first_context_data();
   auto &parms = context_data->parms();
   auto &coeff_modulus = parms.coeff_modulus();
   size_t coeff_count = parms.poly_modulus_degree();
   size_t coeff_mod_count = coeff_modulus.size();
 
-  output.clear();
-  assert(plaintext.size() == coeff_count * coeff_mod_count || plaintext.size() == coeff_count);
+  size_t poly_size = coeff_count * coeff_mod_count;
+  assert(plaintext.size() == poly_size || plaintext.size() == coeff_count);
+  output.resize(2 * l, poly_size);
 
-  uint128_t pow2[coeff_mod_count][l + 1];
+  // pow2[i][j] is base^j modulo the ith modulus, prepared for Shoup
+  // multiplication.
+  auto reducers = utils::make_reducers(coeff_modulus);
+  std::vector<std::vector<utils::ShoupOperand>> pow2(coeff_mod_count,
+                                                     std::vector<utils::ShoupOperand>(l + 1));
   for (int i = 0; i < coeff_mod_count; i++) {
-    uint128_t mod = coeff_modulus[i].value();
-    uint128_t pow = 1;
+    uint64_t pow = 1;
     for (int j = 0; j <= l; j++) {
-      pow2[i][j] = pow;
-      pow = (pow << base_log2) % mod;
+      pow2[i][j] = reducers[i].shoup(pow);
+      pow = reducers[i].reduce(static_cast<uint128_t>(pow) << base_log2);
     }
   }
 
@@ -208,29 +291,23 @@ void GSWEval::encrypt_plain_to_gsw(std::vector<uint64_t> const &plaintext,
       auto ct = cipher.data(poly_id);
       for (int mod_id = 0; mod_id < coeff_mod_count; mod_id++) {
         auto pad = (mod_id * coeff_count);
-        __uint128_t mod = coeff_modulus[mod_id].value();
-        uint64_t coef = pow2[mod_id][i];
+        const utils::Reducer &reducer = reducers[mod_id];
+        const utils::ShoupOperand &coef = pow2[mod_id][i];
         auto pt = plaintext.data();
         if (plaintext.size() == coeff_count * coeff_mod_count) {
           pt = plaintext.data() + pad;
         }
         for (int j = 0; j < coeff_count; j++) {
-          ct[j + pad] =
-              static_cast<uint64_t>((ct[j + pad] + (__uint128_t(pt[j]) * coef % mod)) % mod);
+          ct[j + pad] = reducer.multiply_add(pt[j], coef, ct[j + pad]);
         }
       }
 
       seal::Plaintext pt(coeff_count);
       decryptor.decrypt(cipher, pt);
 
-      std::vector<uint64_t> row;
-      for (int i = 0; i < coeff_count * coeff_mod_count; i++) {
-        row.push_back(cipher.data(0)[i]);
-      }
-      for (int i = 0; i < coeff_count * coeff_mod_count; i++) {
-        row.push_back(cipher.data(1)[i]);
-      }
-      output.push_back(row);
+      size_t row = poly_id * l + (l - 1 - i);
+      std::copy_n(cipher.data(0), poly_size, output.poly(row, 0));
+      std::copy_n(cipher.data(1), poly_size, output.poly(row, 1));
     }
   }
 
@@ -13,18 +13,42 @@ public:
      the given entry index.
   */
   PirQuery generate_query(std::uint64_t entry_index);
+  /*!
+      Generates one query per plaintext holding the given entry, in order.
+     With aligned packing this is a single query; with dense packing an entry
+     may span several plaintexts.
+  */
+  std::vector<PirQuery> generate_entry_queries(std::uint64_t entry_index);
+  /*!
+      Same query as generate_query, except that its second polynomial holds the
+     seed it is sampled from, as SEAL's seeded ciphertexts do. It is only meant
+     to be serialized, which then takes half the bytes; the server reads back
+     the full query.
+  */
+  PirQuery generate_seeded_query(std::uint64_t entry_index);
 
   seal::GaloisKeys create_galois_keys();
+  /*!
+      The keys of create_galois_keys in SEAL's seeded form, for serialization.
+  */
+  seal::Serializable<seal::GaloisKeys> create_seeded_galois_keys();
 
   std::vector<seal::Plaintext> decrypt_result(std::vector<seal::Ciphertext> reply);
   uint32_t client_id;
   seal::Decryptor *get_decryptor();
   /*!
-      Retrieves an entry from the plaintext containing the entry.
+      Retrieves an entry from the plaintext containing the entry. Throws
+     std::invalid_argument if the entry spans several plaintexts.
   */
   Entry get_entry_from_plaintext(size_t entry_index, seal::Plaintext plaintext);
+  /*!
+      Retrieves an entry from the plaintexts answering the queries of
+     generate_entry_queries, decoding it across plaintext boundaries.
+  */
+  Entry get_entry_from_plaintexts(size_t entry_index,
+                                  const std::vector<seal::Plaintext> &plaintexts);
 
-  GSWCiphertext generate_gsw_from_key();
+  GSWMatrix generate_gsw_from_key();
 
 private:
   seal::EncryptionParameters params_;
@@ -43,6 +67,15 @@ private:
   */
   size_t get_database_plain_index(size_t entry_index);
 
+  /*!
+      Generates a query for the plaintext at the given database index.
+  */
+  PirQuery generate_plaintext_query(size_t plaintext_index, bool seeded = false);
+  /*!
+      The Galois elements the server needs to expand a query.
+  */
+  std::vector<uint32_t> get_galois_elts() const;
+
   /*!
       Gets the query indexes for a given plaintext
   */
@@ -8,4 +8,12 @@ constexpr unsigned long long PlaintextMod = 16777259; // Use for 4096
 constexpr unsigned long long CiphertextMod1 = 21873307932344321;
 constexpr unsigned long long CiphertextMod2 = 14832153251168257;
 // Ciphertext Mod1 + Mod2 has a total length of 109 bits
+// Number of coefficients per block of the tiled database layout. Must divide
+// PolyDegree.
+constexpr int TileCoeffs = 64;
+// Plaintexts per thread in each chunk read by the streaming database ingestion.
+constexpr int IngestChunkPlaintexts = 16;
+// Ciphertexts decomposed together by the batched external product. Its
+// workspace holds 2l polynomials for each of them.
+constexpr int ExternalProductBatch = 16;
 } // namespace DatabaseConstants
\ No newline at end of file
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "server.h"
+#include "thread_pool.h"
+#include <cstdint>
+#include <future>
+#include <vector>
+
+/*!
+  Serves the queries of many clients concurrently from one PirServer, so one
+  process and one copy of the database answer them all. Up to max_concurrent
+  queries run at once, each on a thread of the executor, and the remaining ones
+  wait in submission order. The work inside each query is spread over the
+  server's own thread pool.
+*/
+class QueryExecutor {
+public:
+  /*!
+    @param server - server the queries run on. Must outlive the executor.
+    @param max_concurrent - number of queries that run at once
+  */
+  QueryExecutor(PirServer &server, size_t max_concurrent);
+
+  /*!
+    Queues a query and returns a future for the server's reply. Exceptions
+    thrown by make_query, for instance for an unknown client, are rethrown by
+    the future. Queries still queued when the executor is destroyed are run
+    first.
+  */
+  std::future<std::vector<seal::Ciphertext>> submit(uint32_t client_id, PirQuery query);
+
+  size_t max_concurrent() const;
+
+private:
+  PirServer &server_;
+  // A pool of size n has n - 1 workers, and requests only run on the workers.
+  ThreadPool requests_;
+};
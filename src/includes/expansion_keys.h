@@ -0,0 +1,73 @@
+#pragma once
+
+#include "seal/seal.h"
+#include "utils.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/*!
+  The Galois keys of one client for the Galois elements that query expansion
+  uses, copied once out of seal::GaloisKeys into a single buffer laid out in
+  the order the key switch reads it. For each element, and for each key
+  modulus of the decomposition, the two key polynomials of every digit follow
+  each other, already in NTT form.
+
+  apply_galois computes the same ciphertext as seal::Evaluator::apply_galois
+  for a ciphertext of size 2 in coefficient form at the first level, which is
+  where the query is expanded, without the lookups, parameter checks and
+  allocations of SEAL's generic key switch.
+*/
+class ExpansionKeys {
+public:
+  ExpansionKeys() = default;
+
+  /*!
+    Copies the keys of galois_elts out of keys, which were made for the key
+    context of context. Throws std::invalid_argument if one of them is
+    missing.
+  */
+  ExpansionKeys(std::shared_ptr<const seal::SEALContext> context, const seal::GaloisKeys &keys,
+                const std::vector<uint32_t> &galois_elts);
+
+  /*!
+    Takes the keys of galois_elts from size words laid out as data() lays them
+    out, as a key store saved them.
+  */
+  ExpansionKeys(std::shared_ptr<const seal::SEALContext> context,
+                std::vector<uint32_t> galois_elts, const uint64_t *data, size_t size);
+
+  /*!
+    Applies the automorphism x -> x^galois_elt to encrypted and switches the
+    result back to the secret key. destination may be encrypted. Throws
+    std::invalid_argument if there is no key for galois_elt or encrypted is not
+    a coefficient form ciphertext of size 2 at the first level.
+  */
+  void apply_galois(const seal::Ciphertext &encrypted, uint32_t galois_elt,
+                    seal::Ciphertext &destination) const;
+
+  bool has_key(uint32_t galois_elt) const;
+  const std::vector<uint32_t> &galois_elts() const { return galois_elts_; }
+  const uint64_t *data() const { return data_.data(); }
+  /*!
+    Number of words of data().
+  */
+  size_t size() const { return data_.size(); }
+
+private:
+  /*!
+    Offset in data_ of key polynomial k of digit j for key modulus i of the
+    element at elt_index. i is decomp_mod_count_ for the special prime.
+  */
+  size_t key_offset(size_t elt_index, size_t i, size_t j, size_t k) const;
+  size_t words_per_elt() const;
+
+  std::shared_ptr<const seal::SEALContext> context_;
+  std::vector<uint32_t> galois_elts_;
+  size_t coeff_count_ = 0;
+  // Number of coefficient moduli of the first level, which is also the number
+  // of digits of the decomposition.
+  size_t decomp_mod_count_ = 0;
+  utils::AlignedVector<uint64_t> data_;
+};
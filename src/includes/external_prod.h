@@ -1,9 +1,48 @@
 #pragma once
+#include "kernels.h"
 #include "seal/seal.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include <memory>
 #include <vector>
 
-// A GSWCiphertext is a flattened 2lx2 matrix of polynomials
-typedef std::vector<std::vector<uint64_t>> GSWCiphertext;
+/*!
+  A GSW ciphertext: a 2l x 2 matrix of polynomials of coeff_count *
+  coeff_mod_count coefficients each, in one aligned buffer. The external
+  product multiplies decomposed polynomial j with entry (j, k) and sums over j
+  for each output polynomial k, so the entries are stored column by column and
+  the product reads each column as one contiguous stream.
+*/
+class GSWMatrix {
+public:
+  GSWMatrix() = default;
+  GSWMatrix(size_t rows, size_t poly_size) { resize(rows, poly_size); }
+
+  /*!
+    Sets the shape of the matrix. The buffer is kept when it is large enough;
+    the contents are unspecified afterwards.
+  */
+  void resize(size_t rows, size_t poly_size) {
+    rows_ = rows;
+    poly_size_ = poly_size;
+    data_.resize(2 * rows * poly_size);
+  }
+
+  size_t rows() const { return rows_; }
+  size_t poly_size() const { return poly_size_; }
+  bool empty() const { return rows_ == 0; }
+
+  // Entry (row, col), col being 0 or 1.
+  uint64_t *poly(size_t row, size_t col) { return data_.data() + (col * rows_ + row) * poly_size_; }
+  const uint64_t *poly(size_t row, size_t col) const {
+    return data_.data() + (col * rows_ + row) * poly_size_;
+  }
+
+private:
+  size_t rows_ = 0;
+  size_t poly_size_ = 0;
+  utils::AlignedVector<uint64_t> data_;
+};
 
 class GSWEval {
 public:
@@ -17,43 +56,76 @@ public:
     @param res_ct - output ciphertext
   */
 
-  void external_product(GSWCiphertext const &gsw_enc, seal::Ciphertext const &bfv,
-                        size_t ct_poly_size, seal::Ciphertext &res_ct);
+  void external_product(GSWMatrix const &gsw_enc, seal::Ciphertext const &bfv,
+                        size_t ct_poly_size, seal::Ciphertext &res_ct) const;
+
+  /*!
+    Computes the external product between one GSW ciphertext and each of count
+    BFV ciphertexts, in place. As with external_product, the results are left
+    in NTT form.
+    @param pool - pool the batch is spread over, or nullptr to run it on the
+    calling thread
+  */
+  void external_product_batch(GSWMatrix const &gsw_enc, seal::Ciphertext *cts, size_t count,
+                              ThreadPool *pool = nullptr) const;
 
   /*!
     Performs a gadget decomposition of a size 2 BFV ciphertext into 2 sets of
     rows of l polynomials (the 2 sets are concatenated into a single vector of
     vectors). Each polynomial coefficient encodes the value congruent to the
     original ciphertext coefficient modulus the value of base^(l-row).
+    The digits of each coefficient are extracted in a single pass; output is
+    resized to 2l rows and its rows are reused when they already have the
+    right size.
     @param ct - input BFV ciphertext. Should be of size 2.
     @param output - output to store the decomposed ciphertext as a vector of
     vectors of polynomial coefficients
-    @param pool - SEAL memory pool
   */
-  void decomp_rlwe(seal::Ciphertext const &ct, std::vector<std::vector<uint64_t>> &output);
+  void decomp_rlwe(seal::Ciphertext const &ct, std::vector<std::vector<uint64_t>> &output) const;
+  /*!
+    Same decomposition written to 2l consecutive rows of coeff_count *
+    coeff_mod_count coefficients starting at output. Scratch space comes from
+    the calling thread's QueryWorkspace.
+  */
+  void decomp_rlwe(seal::Ciphertext const &ct, uint64_t *output) const;
 
   /*!
     Generates a GSW ciphertext from a BFV ciphertext query.
 
-    @param query - input BFV ciphertext. Should be of size l * 2.
+    @param query - the l BFV ciphertexts of the query for one dimension
+    @param cl - number of query ciphertexts
     @param gsw_key - GSW encryption of -s
-    @param output - output to store the GSW ciphertext as a vector of vectors of
-    polynomial coefficients
+    @param output - output to store the GSW ciphertext; its buffer is reused
+    when it is large enough
+  */
+  void query_to_gsw(const seal::Ciphertext *query, size_t cl, const GSWMatrix &gsw_key,
+                    GSWMatrix &output) const;
+  /*!
+    Generates count GSW ciphertexts at once, selector s from query ciphertexts
+    [s * cl, (s + 1) * cl), into output[0] to output[count - 1].
+    @param pool - pool the work is spread over, or nullptr to run it on the
+    calling thread
   */
-  void query_to_gsw(std::vector<seal::Ciphertext> query, GSWCiphertext gsw_key,
-                    GSWCiphertext &output);
+  void queries_to_gsw(const seal::Ciphertext *query, size_t cl, size_t count,
+                      const GSWMatrix &gsw_key, GSWMatrix *output,
+                      ThreadPool *pool = nullptr) const;
 
   void encrypt_plain_to_gsw(std::vector<uint64_t> const &plaintext,
                             seal::Encryptor const &encryptor, seal::Decryptor &decryptor,
-                            GSWCiphertext &output);
+                            GSWMatrix &output) const;
 
-  void gsw_ntt_negacyclic_harvey(GSWCiphertext &gsw);
-
-  void cyphertext_inverse_ntt(seal::Ciphertext &ct);
+  /*!
+    Transforms rows [row_begin, row_end) of a GSW matrix to NTT form, or every
+    row when no range is given.
+  */
+  void gsw_ntt_negacyclic_harvey(GSWMatrix &gsw) const;
+  void gsw_ntt_negacyclic_harvey(GSWMatrix &gsw, size_t row_begin, size_t row_end) const;
 
-  uint64_t l;
-  uint64_t base_log2;
-  seal::SEALContext const *context;
-};
+  void cyphertext_inverse_ntt(seal::Ciphertext &ct) const;
 
-extern GSWEval data_gsw, key_gsw;
\ No newline at end of file
+  uint64_t l = 0;
+  uint64_t base_log2 = 0;
+  std::shared_ptr<const seal::SEALContext> context;
+  // Kernels for the shape of the first level and l, set with the parameters.
+  const kernels::KernelSet *kernel_set = &kernels::generic();
+};
\ No newline at end of file
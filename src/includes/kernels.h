@@ -0,0 +1,120 @@
+#pragma once
+
+#include "seal/seal.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+/*
+  Kernels specialized on the shape of the ciphertexts. A template parameter of
+  0 is taken from the matching runtime argument instead, so the <0, 0, 0>
+  instantiation is the generic fallback. The other instantiations have
+  compile-time loop bounds that the compiler unrolls and vectorizes; they are
+  listed in kernels.cpp and chosen with select.
+*/
+namespace kernels {
+
+/*!
+  Negacyclic multiplication by x^shift, shift taken modulo 2n, of limbs
+  polynomials of n coefficients stored one after the other, in place.
+  @param moduli - the modulus of each limb
+  @param scratch - room for n coefficients
+*/
+template <size_t N, size_t Limbs>
+void negacyclic_shift(uint64_t *poly, size_t n, size_t limbs, size_t shift,
+                      const seal::Modulus *moduli, uint64_t *scratch) {
+  const size_t coeff_count = N != 0 ? N : n;
+  const size_t coeff_mod_count = Limbs != 0 ? Limbs : limbs;
+  // x^n = -1, so a shift of n or more negates the coefficients that do not
+  // wrap around and keeps the ones that do.
+  const bool negate_head = shift & coeff_count;
+  const size_t s = shift & (coeff_count - 1);
+  const size_t head = coeff_count - s;
+  for (size_t limb = 0; limb < coeff_mod_count; limb++) {
+    uint64_t *limb_ptr = poly + limb * coeff_count;
+    const uint64_t q = moduli[limb].value();
+    std::copy_n(limb_ptr, coeff_count, scratch);
+    auto move = [&](const uint64_t *from, size_t count, uint64_t *to, bool negate) {
+      if (negate) {
+        for (size_t i = 0; i < count; i++) {
+          to[i] = from[i] == 0 ? 0 : q - from[i];
+        }
+      } else {
+        std::copy_n(from, count, to);
+      }
+    };
+    move(scratch, head, limb_ptr + s, negate_head);
+    move(scratch + head, s, limb_ptr, !negate_head);
+  }
+}
+
+/*!
+  Splits n multi-precision coefficients of limbs words each into l digits of
+  base_log2 bits, and writes digit l - 1 - r of every coefficient to row r,
+  copied into each of the limbs of the row. Rows have n * limbs coefficients.
+  The digits must be smaller than every modulus.
+*/
+template <size_t N, size_t Limbs, size_t L>
+void extract_digits(const uint64_t *composed, size_t n, size_t limbs, size_t l, size_t base_log2,
+                    uint64_t *rows) {
+  const size_t coeff_count = N != 0 ? N : n;
+  const size_t coeff_mod_count = Limbs != 0 ? Limbs : limbs;
+  const size_t num_digits = L != 0 ? L : l;
+  const uint64_t mask = base_log2 == 64 ? ~uint64_t(0) : (uint64_t(1) << base_log2) - 1;
+  for (size_t p = 0; p < num_digits; p++) {
+    uint64_t *row = rows + (num_digits - 1 - p) * coeff_count * coeff_mod_count;
+    size_t bit = p * base_log2;
+    size_t word = bit / 64;
+    size_t shift = bit % 64;
+    if (word >= coeff_mod_count) {
+      std::fill_n(row, coeff_count, 0);
+    } else if (shift != 0 && shift + base_log2 > 64 && word + 1 < coeff_mod_count) {
+      // The digit straddles two words.
+      for (size_t k = 0; k < coeff_count; k++) {
+        const uint64_t *value = composed + k * coeff_mod_count + word;
+        row[k] = ((value[0] >> shift) | (value[1] << (64 - shift))) & mask;
+      }
+    } else {
+      for (size_t k = 0; k < coeff_count; k++) {
+        row[k] = (composed[k * coeff_mod_count + word] >> shift) & mask;
+      }
+    }
+    for (size_t limb = 1; limb < coeff_mod_count; limb++) {
+      std::copy_n(row, coeff_count, row + limb * coeff_count);
+    }
+  }
+}
+
+/*!
+  One set of kernels, all specialized for polynomials of n coefficients, limbs
+  coefficient moduli and l digits. The generic set has a shape of zeros.
+*/
+struct KernelSet {
+  size_t n, limbs, l;
+  void (*negacyclic_shift)(uint64_t *poly, size_t n, size_t limbs, size_t shift,
+                           const seal::Modulus *moduli, uint64_t *scratch);
+  void (*extract_digits)(const uint64_t *composed, size_t n, size_t limbs, size_t l,
+                         size_t base_log2, uint64_t *rows);
+
+  /*!
+    Whether negacyclic_shift may be used for polynomials of n coefficients and
+    limbs coefficient moduli.
+  */
+  bool shifts(size_t n, size_t limbs) const {
+    return (this->n == 0 || this->n == n) && (this->limbs == 0 || this->limbs == limbs);
+  }
+};
+
+/*!
+  Returns the kernels specialized for polynomials of n coefficients, limbs
+  coefficient moduli and l digits, or the generic kernels when that shape has
+  no specialization.
+*/
+const KernelSet &select(size_t n, size_t limbs, size_t l);
+
+/*!
+  The generic kernels.
+*/
+const KernelSet &generic();
+
+} // namespace kernels
@@ -0,0 +1,196 @@
+#pragma once
+
+#include "expansion_keys.h"
+#include "external_prod.h"
+#include "seal/seal.h"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/*!
+  Counters of a KeyStore. A lookup of a client whose keys are in memory is a
+  hit, any other lookup a miss; misses that find the keys on disk are loads.
+  Evictions whose spill file could not be written keep the keys in memory and
+  are counted as spill failures.
+*/
+struct KeyStoreStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t loads = 0;
+  uint64_t evictions = 0;
+  uint64_t spill_failures = 0;
+  size_t resident_clients = 0;
+  size_t resident_bytes = 0;
+};
+
+/*!
+  Where PirServer keeps the keys of its clients. Lookups may run concurrently
+  with each other and with updates. A stored key is never modified: setting a
+  key replaces it, and a caller keeps the key it got for as long as it needs.
+*/
+class KeyStore {
+public:
+  virtual ~KeyStore() = default;
+
+  virtual void set_expansion_keys(uint32_t client_id, ExpansionKeys keys) = 0;
+  virtual void set_gsw_key(uint32_t client_id, GSWMatrix key) = 0;
+  /*!
+    The key of a client, or nullptr if it has none.
+  */
+  virtual std::shared_ptr<const ExpansionKeys> expansion_keys(uint32_t client_id) = 0;
+  virtual std::shared_ptr<const GSWMatrix> gsw_key(uint32_t client_id) = 0;
+  /*!
+    Forgets every key of a client.
+  */
+  virtual void erase(uint32_t client_id) = 0;
+  virtual KeyStoreStats stats() const = 0;
+};
+
+/*!
+  KeyStore that keeps up to memory_budget bytes of keys in memory. When the
+  budget is exceeded, clients chosen by CLOCK (an approximation of least
+  recently used) are written to one file each in spill_dir and dropped from
+  memory, and their next lookup loads them back. A spill file holds the GSW key
+  and the expansion keys as raw words at aligned offsets, so it is read by
+  mapping it and copying.
+
+  Clients are spread over NumShards shards, each with its own index, CLOCK
+  ring and mutex. The index of a shard is published like a database snapshot:
+  a lookup of a client in memory reads it with std::atomic_load, takes no lock
+  and writes nothing shared unless it sets the reference bit of the entry.
+  Updates, loads and evictions publish a changed copy of the index under the
+  shard's mutex; spill files are read and written with no shard mutex held,
+  one file operation at a time per shard.
+*/
+class ClientKeyStore : public KeyStore {
+public:
+  /*!
+    @param context - context the expansion keys are loaded with
+    @param memory_budget - bytes of keys kept in memory
+    @param spill_dir - existing directory for the spill files, or empty to keep
+    every key in memory regardless of the budget
+  */
+  explicit ClientKeyStore(std::shared_ptr<const seal::SEALContext> context,
+                          size_t memory_budget = std::numeric_limits<size_t>::max(),
+                          std::string spill_dir = "");
+
+  void set_expansion_keys(uint32_t client_id, ExpansionKeys keys) override;
+  void set_gsw_key(uint32_t client_id, GSWMatrix key) override;
+  std::shared_ptr<const ExpansionKeys> expansion_keys(uint32_t client_id) override;
+  std::shared_ptr<const GSWMatrix> gsw_key(uint32_t client_id) override;
+  void erase(uint32_t client_id) override;
+  KeyStoreStats stats() const override;
+
+private:
+  static constexpr size_t NumShards = 64;
+
+  struct Entry {
+    std::shared_ptr<const ExpansionKeys> expansion;
+    std::shared_ptr<const GSWMatrix> gsw;
+    size_t bytes = 0;
+    // Whether the spill file holds exactly these keys, so that evicting the
+    // entry needs no write.
+    bool on_disk = false;
+    // CLOCK reference bit, set by lookups.
+    mutable std::atomic<bool> referenced{false};
+  };
+  using Index = std::unordered_map<uint32_t, std::shared_ptr<const Entry>>;
+  struct Shard {
+    // The entries lookups find: resident ones and evicted ones whose spill
+    // file is not written yet, so a client is never loaded from a file older
+    // than its keys. Read with std::atomic_load and replaced with
+    // std::atomic_store while holding mutex.
+    std::shared_ptr<const Index> index = std::make_shared<const Index>();
+    // Guards the members below it.
+    mutable std::mutex mutex;
+    // The resident clients in CLOCK order, the position of each in the ring,
+    // and the position of the hand.
+    std::vector<uint32_t> ring;
+    std::unordered_map<uint32_t, size_t> ring_pos;
+    size_t hand = 0;
+    // Clients of index whose spill file is being written.
+    std::unordered_set<uint32_t> spilling;
+    // Incremented by every set and erase of a client, so that an update or a
+    // load can tell whether the keys it started from are still current. Kept
+    // after an erase, so a count never repeats.
+    std::unordered_map<uint32_t, uint64_t> generations;
+    // Serializes the file operations of the shard. Taken before mutex.
+    std::mutex io_mutex;
+  };
+  // A counter of hits, one per cache line, so that lookups on different
+  // threads do not write the same line.
+  struct alignas(64) HitCounter {
+    std::atomic<uint64_t> value{0};
+  };
+
+  Shard &shard_of(uint32_t client_id) { return shards_[client_id % NumShards]; }
+  /*!
+    The entry of a client, loaded from its spill file if it is not in memory,
+    or nullptr if the client has no keys.
+  */
+  std::shared_ptr<const Entry> find(uint32_t client_id);
+  /*!
+    Replaces the entry of a client by a copy of its current one changed by
+    change, then evicts clients until the budget is met.
+  */
+  void update(uint32_t client_id, const std::function<void(Entry &)> &change);
+  /*!
+    Evicts clients other than keep, spilling them if needed, until the budget
+    is met, no shard has another client to evict or a spill fails. Never
+    throws for a failed spill, which is not the caller's concern: the client
+    stays in memory and the failure is counted.
+  */
+  void evict(uint32_t keep);
+  /*!
+    Writes a client evicted into Shard::spilling to its file, unless it was
+    replaced or erased meanwhile. If the file cannot be written, puts the
+    client back in memory and returns false.
+  */
+  bool spill_evicted(Shard &shard, uint32_t client_id, std::shared_ptr<const Entry> entry);
+  /*!
+    The entry of a client in the shard's index, or nullptr. Takes no lock.
+  */
+  static std::shared_ptr<const Entry> lookup(const Shard &shard, uint32_t client_id);
+  // The helpers below are called with the shard's mutex held.
+  static uint64_t generation(const Shard &shard, uint32_t client_id);
+  /*!
+    Publishes a copy of the shard's index where client_id maps to entry, or
+    is absent if entry is null.
+  */
+  static void publish(Shard &shard, uint32_t client_id, std::shared_ptr<const Entry> entry);
+  /*!
+    Makes entry the resident entry of a client, in the index and the ring.
+  */
+  void insert(Shard &shard, uint32_t client_id, std::shared_ptr<const Entry> entry);
+  /*!
+    Takes a client out of the ring and the resident bytes. Its entry stays in
+    the index.
+  */
+  void remove(Shard &shard, uint32_t client_id);
+  std::shared_ptr<Entry> load(uint32_t client_id) const;
+  void spill(uint32_t client_id, const Entry &entry) const;
+  std::string path(uint32_t client_id) const;
+
+  std::shared_ptr<const seal::SEALContext> context_;
+  size_t memory_budget_;
+  std::string spill_dir_;
+  std::array<Shard, NumShards> shards_;
+  // Bytes of the entries resident in all shards.
+  std::atomic<size_t> resident_bytes_{0};
+  // Shard the next eviction starts at.
+  std::atomic<size_t> evict_hand_{0};
+  std::array<HitCounter, NumShards> hits_;
+  std::atomic<uint64_t> misses_{0};
+  std::atomic<uint64_t> loads_{0};
+  std::atomic<uint64_t> evictions_{0};
+  std::atomic<uint64_t> spill_failures_{0};
+};
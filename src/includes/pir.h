@@ -2,8 +2,11 @@
 
 #include "database_constants.h"
 #include "external_prod.h"
+#include "kernels.h"
 #include "seal/seal.h"
+#include <memory>
 #include <stdexcept>
+#include <utility>
 #include <vector>
 
 using namespace seal::util;
@@ -13,6 +16,23 @@ using namespace seal;
 typedef std::vector<uint8_t> Entry;
 typedef Ciphertext PirQuery;
 
+/*!
+  How entries are laid out in the plaintexts of the database.
+  Aligned - each plaintext holds get_num_entries_per_plaintext() whole entries
+  and is padded after the last one.
+  Dense - the entries form one stream of bytes cut into plaintexts, so an entry
+  may continue into the next plaintext. Retrieving such an entry takes one
+  query per plaintext it spans.
+*/
+enum class EntryPacking { Aligned, Dense };
+
+/*!
+  The SEALContext for params. Every caller with the same encryption parameters
+  gets the same context while one of them still holds it.
+*/
+std::shared_ptr<const seal::SEALContext>
+shared_seal_context(const seal::EncryptionParameters &params);
+
 class PirParams {
 public:
   /*!
@@ -22,11 +42,13 @@ public:
       @param num_entries - Number of entries in database
       @param entry_size - Size of each entry in bytes
       @param l - Parameter l for GSW scheme
+      @param l_key - Parameter l for the GSW encryption of the secret key
+      @param packing - Layout of the entries in the plaintexts
       */
   PirParams(uint64_t DBSize, uint64_t ndim, uint64_t num_entries, uint64_t entry_size, uint64_t l,
-            uint64_t l_key)
+            uint64_t l_key, EntryPacking packing = EntryPacking::Aligned)
       : DBSize_(DBSize), seal_params_(seal::EncryptionParameters(seal::scheme_type::bfv)),
-        num_entries_(num_entries), entry_size_(entry_size), l_(l) {
+        num_entries_(num_entries), entry_size_(entry_size), l_(l), packing_(packing) {
     uint64_t first_dim = DBSize >> (ndim - 1);
     if (first_dim < 128) {
       throw std::invalid_argument("Size of first dimension is too small");
@@ -55,7 +77,12 @@ public:
     //     DatabaseConstants::PlaintextModBits));
     seal_params_.set_plain_modulus(DatabaseConstants::PlaintextMod);
 
-    if (DBSize_ * get_num_entries_per_plaintext() < num_entries) {
+    if (get_num_bits_per_plaintext() % 8 != 0) {
+      throw std::invalid_argument("Plaintexts must hold a whole number of bytes");
+    }
+    if (packing_ == EntryPacking::Aligned ? DBSize_ * get_num_entries_per_plaintext() < num_entries
+                                          : DBSize_ * get_num_bytes_per_plaintext() <
+                                                num_entries * entry_size) {
       throw std::invalid_argument("Number of entries in database is too large");
     }
 
@@ -66,15 +93,27 @@ public:
     }
     base_log2_ = (bits + l - 1) / l;
 
-    data_gsw.l = l;
-    data_gsw.base_log2 = base_log2_;
-    data_gsw.context = new seal::SEALContext(seal_params_);
+    auto context = shared_seal_context(seal_params_);
+    size_t n = seal_params_.poly_modulus_degree();
+
+    data_gsw_.l = l;
+    data_gsw_.base_log2 = base_log2_;
+    data_gsw_.context = context;
+    data_gsw_.kernel_set = &kernels::select(n, modulus.size() - 1, l);
 
-    key_gsw.l = l_key;
-    key_gsw.base_log2 = (bits + l_key - 1) / l_key;
-    key_gsw.context = data_gsw.context;
+    key_gsw_.l = l_key;
+    key_gsw_.base_log2 = (bits + l_key - 1) / l_key;
+    key_gsw_.context = context;
+    key_gsw_.kernel_set = &kernels::select(n, modulus.size() - 1, l_key);
   }
   seal::EncryptionParameters get_seal_params() const;
+  /*!
+    GSW evaluators for the selectors of the query (l) and for the encryption
+    of the client's secret key (l_key). Their SEALContext is shared with any
+    parameters that have the same encryption parameters.
+  */
+  const GSWEval &get_data_gsw() const;
+  const GSWEval &get_key_gsw() const;
   void print_values();
   uint64_t get_DBSize() const;
   std::vector<uint64_t> get_dims() const;
@@ -85,6 +124,23 @@ public:
   // Calculates the number of bytes of data each plaintext contains, after
   // aligning the end of an entry to the end of a plaintext.
   size_t get_num_bits_per_plaintext() const;
+  size_t get_num_bytes_per_plaintext() const;
+  EntryPacking get_entry_packing() const;
+  /*!
+    Offset of an entry in the bytes of the database, where plaintext i holds
+    bytes [i * get_num_bytes_per_plaintext(), (i + 1) * get_num_bytes_per_plaintext()).
+  */
+  size_t get_entry_byte_offset(size_t entry_index) const;
+  /*!
+    Index of the first plaintext holding an entry, and the number of
+    consecutive plaintexts the entry spans.
+  */
+  std::pair<size_t, size_t> get_entry_plaintexts(size_t entry_index) const;
+  /*!
+    Range [begin, end) of the entry indices stored, at least in part, in a
+    plaintext. May extend past get_num_entries().
+  */
+  std::pair<size_t, size_t> get_plaintext_entries(size_t plaintext_index) const;
   size_t get_num_entries() const;
   size_t get_entry_size() const;
   uint64_t get_l() const;
@@ -97,7 +153,10 @@ private:
   std::vector<uint64_t> dims_; // Number of dimensions
   size_t num_entries_;         // Number of entries in database
   size_t entry_size_;          // Size of single entry in bytes
+  EntryPacking packing_;       // Layout of the entries in the plaintexts
   seal::EncryptionParameters seal_params_;
+  GSWEval data_gsw_;
+  GSWEval key_gsw_;
 };
 
 void print_entry(Entry entry);
\ No newline at end of file
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "seal/seal.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace utils {
+
+/*!
+  A constant w < q together with floor(w * 2^64 / q), for Shoup
+  multiplication by w.
+*/
+struct ShoupOperand {
+  uint64_t operand = 0;
+  uint64_t quotient = 0;
+};
+
+/*!
+  Reduction modulo one coefficient modulus q < 2^62, without 128-bit division.
+  reduce is a Barrett reduction of any 128-bit value with the precomputed
+  floor(2^128 / q). multiply and multiply_add are Shoup multiplications by a
+  constant prepared once with shoup, for loops that multiply many values by the
+  same constant.
+*/
+class Reducer {
+public:
+  Reducer() = default;
+  explicit Reducer(uint64_t modulus) : q_(modulus) {
+    // floor((2^128 - 1) / q) is floor(2^128 / q), since q is not a power of 2.
+    uint128_t ratio = ~uint128_t(0) / modulus;
+    ratio_lo_ = static_cast<uint64_t>(ratio);
+    ratio_hi_ = static_cast<uint64_t>(ratio >> 64);
+  }
+  explicit Reducer(const seal::Modulus &modulus) : Reducer(modulus.value()) {}
+
+  uint64_t modulus() const { return q_; }
+
+  /*!
+    Returns x mod q. The quotient floor(x * ratio / 2^128) is at most one
+    below floor(x / q), so one conditional subtraction is enough.
+  */
+  uint64_t reduce(uint128_t x) const {
+    uint64_t x_lo = static_cast<uint64_t>(x);
+    uint64_t x_hi = static_cast<uint64_t>(x >> 64);
+    uint128_t lo_lo = static_cast<uint128_t>(x_lo) * ratio_lo_;
+    uint128_t lo_hi = static_cast<uint128_t>(x_lo) * ratio_hi_;
+    uint128_t hi_lo = static_cast<uint128_t>(x_hi) * ratio_lo_;
+    uint128_t middle = (lo_lo >> 64) + static_cast<uint64_t>(lo_hi) + static_cast<uint64_t>(hi_lo);
+    uint64_t quotient = x_hi * ratio_hi_ + static_cast<uint64_t>(lo_hi >> 64) +
+                        static_cast<uint64_t>(hi_lo >> 64) + static_cast<uint64_t>(middle >> 64);
+    uint64_t r = x_lo - quotient * q_;
+    return r >= q_ ? r - q_ : r;
+  }
+
+  /*!
+    Prepares w for multiply and multiply_add. w is reduced first if needed.
+  */
+  ShoupOperand shoup(uint64_t w) const {
+    w = w >= q_ ? w % q_ : w;
+    return {w, static_cast<uint64_t>((static_cast<uint128_t>(w) << 64) / q_)};
+  }
+
+  /*!
+    Returns a value congruent to x * w in [0, 2q), for any 64-bit x.
+  */
+  uint64_t multiply_lazy(uint64_t x, const ShoupOperand &w) const {
+    uint64_t estimate = static_cast<uint64_t>((static_cast<uint128_t>(x) * w.quotient) >> 64);
+    return x * w.operand - estimate * q_;
+  }
+
+  /*!
+    Returns x * w mod q, for any 64-bit x.
+  */
+  uint64_t multiply(uint64_t x, const ShoupOperand &w) const {
+    uint64_t r = multiply_lazy(x, w);
+    return r >= q_ ? r - q_ : r;
+  }
+
+  /*!
+    Returns (acc + x * w) mod q, for acc < q and any 64-bit x.
+  */
+  uint64_t multiply_add(uint64_t x, const ShoupOperand &w, uint64_t acc) const {
+    uint64_t r = multiply(x, w) + acc;
+    return r >= q_ ? r - q_ : r;
+  }
+
+  /*!
+    Reduces count 128-bit values into out.
+  */
+  void reduce(const uint128_t *in, size_t count, uint64_t *out) const {
+    for (size_t i = 0; i < count; i++) {
+      out[i] = reduce(in[i]);
+    }
+  }
+
+private:
+  uint64_t q_ = 0;
+  uint64_t ratio_lo_ = 0;
+  uint64_t ratio_hi_ = 0;
+};
+
+/*!
+  One Reducer per coefficient modulus, in the same order.
+*/
+inline std::vector<Reducer> make_reducers(const std::vector<seal::Modulus> &coeff_modulus) {
+  return std::vector<Reducer>(coeff_modulus.begin(), coeff_modulus.end());
+}
+
+} // namespace utils
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "external_prod.h"
+#include "pir.h"
+#include "seal/seal.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/*
+  Binary wire format between client and server. A buffer holds one or more
+  messages, each a MessageHeader followed by payload_size bytes, in native
+  (little-endian) byte order:
+
+  Params - the PirParams of the server and its encryption parameters, sent
+  first so the client builds the same PirParams with read_params.
+  Query - a PirQuery serialized by SEAL. A query from
+  PirClient::generate_seeded_query carries the seed of its second polynomial
+  instead of the polynomial, which halves it.
+  GaloisKeys - serialized by SEAL, seeded when written from the
+  seal::Serializable that PirClient::create_seeded_galois_keys returns.
+  GSWKey - the rows and polynomial size of the matrix, then its coefficients.
+  Response - the number of ciphertexts, then for each one a CiphertextHeader
+  and its coefficients.
+
+  Coefficients are bit-packed, limb by limb, with as many bits as the modulus
+  of the limb has, which is what makes the GSW key and the response smaller
+  than SEAL's uncompressed serialization. Every message carries the
+  params_digest of the parameters it was made for, and a reader with other
+  parameters rejects it.
+*/
+namespace serialization {
+
+constexpr uint16_t WireVersion = 1;
+
+enum class MessageType : uint16_t {
+  Params = 1,
+  Query = 2,
+  GaloisKeys = 3,
+  GSWKey = 4,
+  Response = 5,
+};
+
+struct MessageHeader {
+  char magic[4];
+  uint16_t version;
+  uint16_t type;
+  uint64_t params_digest;
+  uint64_t payload_size;
+};
+
+struct CiphertextHeader {
+  uint32_t size;            // number of polynomials
+  uint32_t coeff_mod_count; // selects the level
+  uint32_t ntt_form;
+  uint32_t reserved;
+};
+
+/*!
+  Fingerprint of the parameters that client and server must share: those of
+  the PirParams constructor and the encryption parameters.
+*/
+uint64_t params_digest(const PirParams &params);
+
+/*!
+  Appends a Params message to out.
+*/
+void write_params(const PirParams &params, std::vector<uint8_t> &out);
+
+/*!
+  Builds the PirParams of the Params message at data. Throws
+  std::runtime_error if the message is malformed or this build cannot make the
+  same encryption parameters.
+*/
+PirParams read_params(const uint8_t *data, size_t size);
+
+/*!
+  Appends messages for params to a buffer owned by the caller, which can keep
+  the buffer from one request to the next.
+*/
+class MessageWriter {
+public:
+  MessageWriter(const PirParams &params, std::vector<uint8_t> &out);
+
+  void write_query(const PirQuery &query);
+  void write_galois_keys(const seal::GaloisKeys &keys);
+  void write_galois_keys(const seal::Serializable<seal::GaloisKeys> &keys);
+  void write_gsw_key(const GSWMatrix &key);
+  void write_response(const std::vector<seal::Ciphertext> &reply);
+
+private:
+  /*!
+    Appends the header of a message with payload_size bytes and returns where
+    the payload goes.
+  */
+  uint8_t *begin_message(MessageType type, size_t payload_size);
+  template <typename T> void write_seal_object(MessageType type, const T &object);
+
+  std::shared_ptr<const seal::SEALContext> context_;
+  uint64_t digest_;
+  std::vector<uint8_t> &out_;
+};
+
+/*!
+  Reads the messages of a buffer for params, in order. The buffer is not
+  copied and must outlive the reader. Responses and GSW keys are unpacked
+  straight into the caller's objects, which keep their allocation when they
+  already have the right shape. Throws std::runtime_error on a malformed or
+  truncated message, on one made for other parameters, and when the next
+  message is not of the type read.
+*/
+class MessageReader {
+public:
+  MessageReader(const PirParams &params, const uint8_t *data, size_t size);
+
+  bool done() const { return offset_ == size_; }
+  MessageType next_type() const;
+
+  void read_query(PirQuery &query);
+  void read_galois_keys(seal::GaloisKeys &keys);
+  void read_gsw_key(GSWMatrix &key);
+  void read_response(std::vector<seal::Ciphertext> &reply);
+
+private:
+  /*!
+    Checks the header of the next message and returns its payload, moving past
+    the message.
+  */
+  const uint8_t *next_payload(MessageType type, size_t &payload_size);
+
+  std::shared_ptr<const seal::SEALContext> context_;
+  uint64_t digest_;
+  const uint8_t *data_;
+  size_t size_;
+  size_t offset_ = 0;
+};
+
+} // namespace serialization
@@ -2,12 +2,84 @@
 
 #include "client.h"
 #include "external_prod.h"
+#include "kernels.h"
+#include "key_store.h"
 #include "pir.h"
 #include "seal/seal.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <optional>
 
 typedef std::vector<std::optional<seal::Plaintext>> Database;
 
+/*!
+  Fills buffer with up to max_entries entries of entry_size bytes each and
+  returns the number of entries written. Returning 0 ends the database.
+*/
+typedef std::function<size_t(uint8_t *buffer, size_t max_entries)> EntryReader;
+
+/*!
+  Memory layout of the preprocessed database.
+  Plaintexts - one NTT plaintext per database slot.
+  Tiled - one 64-byte aligned buffer ordered as coefficient block x column x row,
+  so that the first dimension streams the database sequentially.
+  Compact - memory optimized. Plaintexts are kept in coefficient form with each
+  coefficient packed into get_num_bits_per_coeff() bits, and are transformed to
+  NTT form inside the first dimension, one plaintext at a time.
+*/
+enum class DatabaseLayout { Plaintexts, Tiled, Compact };
+
+/*!
+  How the first query ciphertext is expanded.
+  Copy - each node of the expansion tree is computed into new ciphertexts, and
+  the leaves are in coefficient form.
+  InPlace - the leaves are allocated once per query and the nodes are updated
+  in place, with one scratch ciphertext per task. The leaves of the first
+  dimension are transformed to NTT form as soon as they are produced, so the
+  first dimension uses them as they are.
+  Streaming - make_query expands the tree depth-first and adds each first
+  dimension leaf to the first dimension accumulators as soon as it is
+  produced, so a query holds O(tree depth) ciphertexts per task and one
+  accumulator per column instead of dims_[0] leaves. Other paths expand in
+  place.
+*/
+enum class ExpansionMode { Copy, InPlace, Streaming };
+
+/*!
+  One version of the preprocessed database. A snapshot is not modified once it
+  is published, and a query keeps the snapshot it started on alive until it
+  returns. Only the members of its layout are used.
+*/
+struct DatabaseSnapshot {
+  uint64_t version = 0;
+  DatabaseLayout layout = DatabaseLayout::Plaintexts;
+  Database plaintexts;
+  // Tiled layout: for each block of DatabaseConstants::TileCoeffs NTT
+  // coefficients, the blocks of every plaintext ordered by column, then row.
+  utils::AlignedVector<uint64_t> tiles;
+  // Start of the tiled database: tiles or a mapped database file.
+  const uint64_t *tiles_ptr = nullptr;
+  std::shared_ptr<const utils::MappedFile> mapping;
+  // Compact layout: compact_words_per_plaintext() words per plaintext.
+  std::vector<uint64_t> compact;
+  std::vector<uint8_t> compact_present;
+  // Plaintexts that differ from the previous version, when this version was
+  // made by update_entries.
+  std::optional<std::vector<size_t>> changed_plaintexts;
+};
+
+/*!
+  make_query, make_queries and the other query functions may be called from
+  several threads at once. They only read the server's state (the evaluator is
+  used through its const functions), keep their own references to the
+  database snapshot and client keys, and take their buffers from the calling
+  thread's QueryWorkspace. The queries share the server's thread pool.
+  QueryExecutor runs queries of many clients this way.
+*/
 class PirServer {
 public:
   PirServer(const PirParams &pir_params);
@@ -16,45 +88,261 @@ public:
   */
   void gen_data();
   /*!
-    Sets the database to a new database
+    Sets the database to a new database. The new version is built while
+    queries keep running on the current one, then published atomically.
+    @return the version of the new database
   */
-  void set_database(std::vector<Entry> &new_db);
+  uint64_t set_database(std::vector<Entry> &new_db);
+  /*!
+    Sets the database to the entries produced by reader, in order, without
+    holding them all in memory. Entries are read one chunk of plaintexts at a
+    time while the previous chunk is packed and transformed on the pool, so
+    besides the database only two chunks are in memory. Reading stops after
+    DBSize plaintexts.
+    @return the version of the new database
+  */
+  uint64_t set_database_from_reader(const EntryReader &reader);
+  /*!
+    Sets the database from a file of consecutive entry_size byte entries with
+    set_database_from_reader. A trailing partial entry is padded with zeros.
+  */
+  uint64_t set_database_from_file(const std::string &path);
+  /*!
+    Replaces individual entries of the database. Only the plaintexts holding
+    the updated entries are re-encoded and transformed. Entries are padded to
+    entry_size like in set_database; an empty entry clears its slot.
+    The updates are applied to a copy of the database and published as a new
+    version. The copy reuses the buffers of the version before the current
+    one once no query holds it, and then only the plaintexts changed since
+    that version are copied.
+    @param updates - pairs of entry index and new entry
+    @return the version of the updated database
+  */
+  uint64_t update_entries(const std::vector<std::pair<size_t, Entry>> &updates);
+  /*!
+    Runs set_database or update_entries on a background thread. The server
+    must outlive the returned future.
+  */
+  std::future<uint64_t> set_database_async(std::vector<Entry> new_db);
+  std::future<uint64_t> update_entries_async(std::vector<std::pair<size_t, Entry>> updates);
+  /*!
+    Version of the database new queries run on, or 0 if there is none.
+  */
+  uint64_t get_database_version() const;
   std::vector<seal::Ciphertext> make_query(uint32_t client_id, PirQuery &&query);
+  /*!
+    Answers several queries at once. The first dimension of all queries is
+    evaluated in a single pass over the database, so each plaintext is loaded
+    once per batch instead of once per query. Results are in the same order as
+    the queries.
+  */
+  std::vector<std::vector<seal::Ciphertext>>
+  make_queries(std::vector<std::pair<uint32_t, PirQuery>> queries);
   std::vector<seal::Ciphertext> make_query_delayed_mod(uint32_t client_id, PirQuery query);
   std::vector<seal::Ciphertext> make_query_regular_mod(uint32_t client_id, PirQuery query);
   std::vector<seal::Ciphertext> evaluate_gsw_product(std::vector<seal::Ciphertext> &result,
-                                                     GSWCiphertext &selection_cipher);
+                                                     const GSWMatrix &selection_cipher);
+  /*!
+    Registers or replaces the keys of a client. Safe to call while queries
+    run; a query keeps using the keys it started with. Only the Galois keys
+    that query expansion uses are kept, as ExpansionKeys; the client must have
+    made them all.
+  */
   void set_client_galois_key(uint32_t client_id, seal::GaloisKeys client_key);
-  void set_client_gsw_key(uint32_t client_id, GSWCiphertext &&gsw_key);
+  void set_client_gsw_key(uint32_t client_id, GSWMatrix &&gsw_key);
+  /*!
+    Replaces where the client keys are kept. Defaults to a ClientKeyStore that
+    keeps every key in memory. Keys already registered are not moved to the
+    new store. Must not be called while queries run.
+  */
+  void set_key_store(std::shared_ptr<KeyStore> key_store);
+  std::shared_ptr<KeyStore> get_key_store() const;
+  /*!
+    Sets the number of threads used to evaluate a query. Defaults to the number of hardware
+    threads. Must not be called while queries run.
+  */
+  void set_num_threads(size_t num_threads);
+  /*!
+    Runs queries on pool, which may be shared with other servers, for example
+    ones serving tables with different parameters in the same process. Must not
+    be called while queries run.
+  */
+  void set_thread_pool(std::shared_ptr<ThreadPool> pool);
+  std::shared_ptr<ThreadPool> get_thread_pool() const;
+  size_t get_num_threads() const;
+  /*!
+    Sets the layout used by the next call to set_database.
+  */
+  void set_database_layout(DatabaseLayout layout);
+  void set_expansion_mode(ExpansionMode mode);
+  /*!
+    Writes the preprocessed (NTT) database to a file, in tiled order, together
+    with the parameters it was built for and a checksum. Not available with the
+    compact layout.
+  */
+  void save_database(const std::string &path);
+  /*!
+    Loads a database written by save_database. The file is memory-mapped
+    read-only and used in place with the tiled layout, so several servers on a
+    host share one copy in the page cache. Throws std::invalid_argument if the
+    file was written for different parameters or fails the checksum.
+    @return the version of the loaded database
+  */
+  uint64_t load_database(const std::string &path, bool verify_checksum = true);
 
-  seal::Decryptor *decryptor_;
+  // Optional, only used to print the noise budget of the first dimension.
+  // Must not be changed while queries run.
+  seal::Decryptor *decryptor_ = nullptr;
 
 private:
   uint64_t DBSize_;
   seal::SEALContext context_;
   seal::Evaluator evaluator_;
   std::vector<uint64_t> dims_;
-  std::map<uint32_t, seal::GaloisKeys> client_galois_keys_;
-  std::map<uint32_t, GSWCiphertext> client_gsw_keys_;
-  Database db_;
+  // Keys of the clients. A query holds its own reference to the keys it uses.
+  std::shared_ptr<KeyStore> key_store_;
+  // Current database. Read with std::atomic_load and replaced with
+  // std::atomic_exchange, so queries never wait for an update.
+  std::shared_ptr<DatabaseSnapshot> db_;
+  // The version db_ replaced, reused for the next version once no query
+  // holds it. Only used while holding db_writer_mutex_.
+  std::shared_ptr<DatabaseSnapshot> db_retired_;
+  // Serializes the functions that publish a new version.
+  std::mutex db_writer_mutex_;
+  uint64_t db_version_ = 0;
+  DatabaseLayout db_layout_ = DatabaseLayout::Plaintexts;
+  ExpansionMode expansion_mode_ = ExpansionMode::InPlace;
   PirParams pir_params_;
+  std::shared_ptr<ThreadPool> pool_;
+  // Initial size of the QueryWorkspace of a thread making queries, from the
+  // parameters. Workspaces grow past it when a query needs more.
+  size_t workspace_bytes_ = 0;
+  // Kernels for the first level, where the query is expanded.
+  const kernels::KernelSet *kernels_ = &kernels::generic();
 
+  /*!
+    The keys of a client. Throws std::invalid_argument if the client has none.
+  */
+  std::shared_ptr<const ExpansionKeys> expansion_keys(uint32_t client_id) const;
+  std::shared_ptr<const GSWMatrix> gsw_key(uint32_t client_id) const;
+  /*!
+    The Galois elements N / 2^a + 1 of the levels a of the expansion tree.
+  */
+  std::vector<uint32_t> expansion_galois_elts() const;
   /*!
     Expands the first query ciphertext into a selection vector of ciphertexts
     where the ith ciphertext encodes the ith bit of the first query ciphertext.
   */
   std::vector<seal::Ciphertext> expand_query(uint32_t client_id, seal::Ciphertext ciphertext);
+  std::vector<seal::Ciphertext> expand_query_inplace(uint32_t client_id,
+                                                     const seal::Ciphertext &ciphertext);
+  /*!
+    Multiplies ct by x^shift in place. scratch is resized to hold one
+    polynomial.
+  */
+  void shift_inplace(seal::Ciphertext &ct, size_t shift, std::vector<uint64_t> &scratch) const;
   /*!
     Performs a cross product between the first selection vector and the
-    database.
+    database. Selection ciphertexts may be in coefficient or NTT form.
   */
-  std::vector<seal::Ciphertext> evaluate_first_dim(std::vector<seal::Ciphertext> &selection_vector);
+  std::vector<seal::Ciphertext> evaluate_first_dim(const DatabaseSnapshot &db,
+                                                   std::vector<seal::Ciphertext> &selection_vector);
   std::vector<seal::Ciphertext>
-  evaluate_first_dim_delayed_mod(std::vector<seal::Ciphertext> &selection_vector);
+  evaluate_first_dim_delayed_mod(const DatabaseSnapshot &db,
+                                 std::vector<seal::Ciphertext> &selection_vector);
+  /*!
+    Expands the query depth-first and evaluates the first dimension on the
+    leaves as they are produced. Only the GSW leaves are kept: query_vector is
+    resized to the number of leaves and filled from index dims_[0] on, ready
+    for evaluate_other_dims. walk_bytes is set to the bytes of the
+    ciphertexts the walks of the subtrees held.
+  */
+  std::vector<seal::Ciphertext>
+  evaluate_first_dim_streaming(const DatabaseSnapshot &db, uint32_t client_id,
+                               const seal::Ciphertext &query,
+                               std::vector<seal::Ciphertext> &query_vector, size_t &walk_bytes);
+  /*!
+    Delayed modulus first dimension for a batch of selection vectors, computed
+    as a matrix-matrix product with the database.
+  */
+  std::vector<std::vector<seal::Ciphertext>>
+  evaluate_first_dim_batched(const DatabaseSnapshot &db,
+                             std::vector<std::vector<seal::Ciphertext>> &selection_vectors);
+  /*!
+    Builds the GSW selectors of dimensions 1 to ndim-1 from the expanded query,
+    all at once on the pool. selectors is resized to ndim-1 and its buffers
+    are reused.
+  */
+  void build_selectors(uint32_t client_id, const std::vector<seal::Ciphertext> &query_vector,
+                       std::vector<GSWMatrix> &selectors);
+  /*!
+    Evaluates dimensions 1 to ndim-1 of a query on the output of the first
+    dimension, with the selectors from build_selectors.
+  */
+  std::vector<seal::Ciphertext> evaluate_other_dims(const std::vector<GSWMatrix> &selectors,
+                                                    std::vector<seal::Ciphertext> result);
+  /*!
+    Delayed modulus first dimension over the tiled database layout. Selection
+    vector should already be in NTT form.
+  */
+  std::vector<seal::Ciphertext>
+  evaluate_first_dim_tiled(const DatabaseSnapshot &db,
+                           const std::vector<seal::Ciphertext> &selection_vector);
 
+  /*!
+    Returns the current database, which stays valid for as long as the
+    returned pointer is held. Throws std::logic_error if there is none.
+  */
+  std::shared_ptr<const DatabaseSnapshot> pin_database() const;
+  /*!
+    Returns a snapshot to build the next version in: the retired version if
+    it has the given layout and no query holds it, otherwise a new one.
+  */
+  std::shared_ptr<DatabaseSnapshot> next_snapshot(DatabaseLayout layout);
+  /*!
+    Makes next the current database and retires the previous one. Requires
+    db_writer_mutex_.
+  */
+  uint64_t publish(std::shared_ptr<DatabaseSnapshot> next);
   /*!
     Transforms the plaintexts in the database into their NTT representation.
-    This speeds up computation but takes up more memory.
+    This speeds up computation but takes up more memory. With the tiled layout
+    the plaintexts are then moved into db.tiles.
+  */
+  void preprocess_ntt(DatabaseSnapshot &db);
+  /*!
+    Allocates the storage of the layout of db, with every plaintext missing.
+  */
+  void allocate_database(DatabaseSnapshot &db);
+  void build_tiles(DatabaseSnapshot &db);
+  void build_compact(DatabaseSnapshot &db);
+  size_t compact_words_per_plaintext() const;
+  /*!
+    Returns the NTT form of the plaintext at index, or nullptr if it is
+    missing. With the compact layout the plaintext is unpacked and transformed
+    into scratch, which holds coeff_count * coeff_mod_count words. Not
+    available with the tiled layout.
+  */
+  const uint64_t *ntt_plaintext(const DatabaseSnapshot &db, size_t index,
+                                uint64_t *scratch) const;
+  /*!
+    Returns the coefficient form of the plaintext at index, or zeros if it is
+    missing.
+  */
+  std::vector<uint64_t> plaintext_coeffs(const DatabaseSnapshot &db, size_t index) const;
+  /*!
+    Encodes coefficient form coeffs as the plaintext at index in the layout
+    of db.
+  */
+  void store_plaintext(DatabaseSnapshot &db, size_t index, const std::vector<uint64_t> &coeffs);
+  /*!
+    Copies the database in from into to, which gets the layout of from. A
+    mapped database file is copied into memory.
+  */
+  void copy_database(const DatabaseSnapshot &from, DatabaseSnapshot &to);
+  /*!
+    Copies the plaintext at index from one database to another of the same
+    layout.
   */
-  void preprocess_ntt();
+  void copy_plaintext(const DatabaseSnapshot &from, DatabaseSnapshot &to, size_t index);
 };
\ No newline at end of file
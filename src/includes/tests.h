@@ -7,5 +7,25 @@
 void run_tests();
 void bfv_example();
 void test_external_product();
+void test_decomp_rlwe();
+void test_external_product_batch();
+void test_query_workspace();
+void test_reduction();
+void test_kernels();
+void test_expansion_keys();
+void test_multiply_poly_acum();
 void test_keyword_pir();
-void test_pir();
\ No newline at end of file
+void test_pir();
+void test_batch_pir();
+void test_concurrent_queries();
+void test_multiple_params();
+void test_key_store();
+void test_key_store_concurrent_load();
+void test_serialization();
+void test_database_file();
+void test_database_layouts();
+void test_update_entries();
+void test_database_snapshots();
+void test_database_streaming();
+void test_dense_packing();
+void test_expansion_modes();
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+/*!
+  A fixed-size pool of worker threads. The thread calling parallel_for takes part in the work,
+  so a task that is already running on the pool can call parallel_for without deadlocking.
+*/
+class ThreadPool {
+public:
+  /*!
+    @param num_threads - number of threads that work on a parallel_for, including the calling
+    thread. A pool of size 1 runs everything on the caller.
+  */
+  explicit ThreadPool(size_t num_threads = std::thread::hardware_concurrency());
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /*!
+    Number of threads that take part in a parallel_for, including the caller.
+  */
+  size_t size() const;
+
+  /*!
+    Calls fn(i) for every i in [begin, end), spreading the indices over the pool. Returns once
+    every call has finished. The first exception thrown by fn is rethrown on the caller.
+  */
+  void parallel_for(size_t begin, size_t end, const std::function<void(size_t)> &fn);
+
+  /*!
+    Queues a task on the pool and returns a future for its result. With no worker threads the
+    task runs immediately on the caller.
+  */
+  template <class F> auto submit(F &&task) -> std::future<decltype(task())> {
+    using Result = decltype(task());
+    auto packaged = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(task));
+    auto future = packaged->get_future();
+    if (workers_.empty()) {
+      (*packaged)();
+    } else {
+      enqueue([packaged]() { (*packaged)(); });
+    }
+    return future;
+  }
+
+private:
+  void enqueue(std::function<void()> task);
+  void worker_loop();
+
+  std::vector<std::thread> workers_;
+  std::queue<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopping_ = false;
+};
@@ -1,6 +1,12 @@
 #pragma once
 #include "seal/seal.h"
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
 
 template <typename T> std::string to_string(T x) {
   std::string ret;
@@ -29,6 +35,72 @@ template <typename T> inline void debug(T *ptr, std::string name, int cnt) {
 }
 
 namespace utils {
+/*!
+    Allocator returning memory aligned to Alignment bytes (a cache line by
+   default), so that vectorized kernels can stream through it.
+*/
+template <typename T, size_t Alignment = 64> struct AlignedAllocator {
+  using value_type = T;
+  template <typename U> struct rebind {
+    using other = AlignedAllocator<U, Alignment>;
+  };
+
+  AlignedAllocator() = default;
+  template <typename U> AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+  T *allocate(size_t n) {
+    size_t bytes = (n * sizeof(T) + Alignment - 1) / Alignment * Alignment;
+    void *ptr = std::aligned_alloc(Alignment, bytes);
+    if (ptr == nullptr) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T *>(ptr);
+  }
+  void deallocate(T *ptr, size_t) { std::free(ptr); }
+
+  template <typename U> bool operator==(const AlignedAllocator<U, Alignment> &) const {
+    return true;
+  }
+  template <typename U> bool operator!=(const AlignedAllocator<U, Alignment> &) const {
+    return false;
+  }
+};
+
+template <typename T> using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+/*!
+    A file mapped read-only into memory. Pages are shared with every other
+   process mapping the same file. Throws std::runtime_error if the file cannot
+   be mapped.
+*/
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path);
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+/*!
+    64-bit FNV-1a style checksum over 64-bit words. Pass the previous result as
+   seed to checksum data in several pieces.
+*/
+inline uint64_t checksum64(const uint64_t *data, size_t count,
+                           uint64_t seed = 0xcbf29ce484222325ULL) {
+  uint64_t hash = seed;
+  for (size_t i = 0; i < count; i++) {
+    hash = (hash ^ data[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
 /*!
     Helper function for multiply_poly_acum. Multiplies two operands together and
    stores the result in product_acum.
@@ -37,17 +109,21 @@ inline void multiply_acum(uint64_t op1, uint64_t op2, __uint128_t &product_acum)
   product_acum = product_acum + static_cast<__uint128_t>(op1) * static_cast<__uint128_t>(op2);
 }
 
+typedef void (*MultiplyPolyAcumFn)(const uint64_t *ct_ptr, const uint64_t *pt_ptr, size_t size,
+                                   uint128_t *result);
+
 /*!
     Multiplies two polynomials in NTT form together and adds the result to a
-   third polynomial in NTT form.
+   third polynomial in NTT form. Portable version, unrolled by 32.
     @param ct_ptr - Pointer to the start of the data of the first polynomial
     @param pt_ptr - Pointer to the start of the data of the second polynomial
     @param size - Number of polynomial coefficients
     @param result - Pointer to the start of the data of the result polynomial
 */
-inline void multiply_poly_acum(const uint64_t *ct_ptr, const uint64_t *pt_ptr, size_t size,
-                               uint128_t *result) {
-  for (int cc = 0; cc < size; cc += 32) {
+inline void multiply_poly_acum_scalar(const uint64_t *ct_ptr, const uint64_t *pt_ptr, size_t size,
+                                      uint128_t *result) {
+  size_t cc = 0;
+  for (; cc + 32 <= size; cc += 32) {
     multiply_acum(ct_ptr[cc], pt_ptr[cc], result[cc]);
     multiply_acum(ct_ptr[cc + 1], pt_ptr[cc + 1], result[cc + 1]);
     multiply_acum(ct_ptr[cc + 2], pt_ptr[cc + 2], result[cc + 2]);
@@ -81,7 +157,88 @@ inline void multiply_poly_acum(const uint64_t *ct_ptr, const uint64_t *pt_ptr, s
     multiply_acum(ct_ptr[cc + 30], pt_ptr[cc + 30], result[cc + 30]);
     multiply_acum(ct_ptr[cc + 31], pt_ptr[cc + 31], result[cc + 31]);
   }
+  for (; cc < size; cc++) {
+    multiply_acum(ct_ptr[cc], pt_ptr[cc], result[cc]);
+  }
+}
+
+/*!
+    Vectorized versions of multiply_poly_acum_scalar. They must only be called
+   when the CPU supports the instruction set, see multiply_poly_acum_kernel.
+   The IFMA version requires both operands to be less than 2^52.
+*/
+void multiply_poly_acum_avx2(const uint64_t *ct_ptr, const uint64_t *pt_ptr, size_t size,
+                             uint128_t *result);
+void multiply_poly_acum_avx512(const uint64_t *ct_ptr, const uint64_t *pt_ptr, size_t size,
+                               uint128_t *result);
+void multiply_poly_acum_avx512ifma(const uint64_t *ct_ptr, const uint64_t *pt_ptr, size_t size,
+                                   uint128_t *result);
+
+/*!
+    Returns the fastest multiply_poly_acum kernel supported by this CPU for
+   operands of at most operand_bits bits.
+*/
+MultiplyPolyAcumFn multiply_poly_acum_kernel(int operand_bits = 64);
+
+/*!
+    Returns every multiply_poly_acum kernel supported by this CPU for operands
+   of at most operand_bits bits, with its name. The scalar kernel comes first.
+*/
+std::vector<std::pair<std::string, MultiplyPolyAcumFn>>
+multiply_poly_acum_variants(int operand_bits = 64);
+
+/*!
+    Bit count of the largest modulus, i.e. the operand width to pass to
+   multiply_poly_acum_kernel for polynomials reduced by these moduli.
+*/
+inline int max_bit_count(const std::vector<seal::Modulus> &coeff_modulus) {
+  int bits = 0;
+  for (auto &modulus : coeff_modulus) {
+    bits = std::max(bits, modulus.bit_count());
+  }
+  return bits;
 }
+
+/*!
+    Multiplies two polynomials in NTT form together and adds the result to a
+   third polynomial in NTT form, using the fastest kernel for 64-bit operands.
+    @param ct_ptr - Pointer to the start of the data of the first polynomial
+    @param pt_ptr - Pointer to the start of the data of the second polynomial
+    @param size - Number of polynomial coefficients
+    @param result - Pointer to the start of the data of the result polynomial
+*/
+inline void multiply_poly_acum(const uint64_t *ct_ptr, const uint64_t *pt_ptr, size_t size,
+                               uint128_t *result) {
+  static const MultiplyPolyAcumFn kernel = multiply_poly_acum_kernel();
+  kernel(ct_ptr, pt_ptr, size, result);
+}
+/*!
+    Packs count values of bits bits each (bits <= 64) into consecutive bits of
+   packed, which must hold (count * bits + 63) / 64 zeroed words.
+*/
+void pack_coeffs(const uint64_t *coeffs, size_t count, size_t bits, uint64_t *packed);
+
+/*!
+    Inverse of pack_coeffs.
+*/
+void unpack_coeffs(const uint64_t *packed, size_t count, size_t bits, uint64_t *coeffs);
+
+/*!
+    Splits num_bytes bytes, read as a little-endian bit stream, into
+   coefficients of bits bits each (bits < 64), 64 bits at a time. The last
+   coefficient is zero-padded. This is the packing of PirServer::set_database.
+   @return the number of coefficients written
+*/
+size_t bytes_to_coeffs(const uint8_t *bytes, size_t num_bytes, size_t bits, uint64_t *coeffs);
+
+/*!
+    Writes the bytes of entry into the bit stream held by a plaintext, where
+   each coefficient holds the next bits_per_coeff bits, starting at bit_offset.
+   This is the packing used by PirServer::set_database.
+*/
+void write_entry_bits(const uint8_t *entry, size_t entry_size, size_t bit_offset,
+                      size_t bits_per_coeff, uint64_t *coeffs);
+
 void negacyclic_shift_poly_coeffmod(seal::util::ConstCoeffIter poly, size_t coeff_count,
                                     size_t shift, const seal::Modulus &modulus,
                                     seal::util::CoeffIter result);
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "external_prod.h"
+#include "utils.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*!
+  Per-thread arena for the buffers of query processing. Buffers are taken with
+  allocate and given back in stack order by Scope, so the arena is empty again
+  when the outermost scope of a thread ends, which happens between queries.
+  When more was in use at once than the arena holds, the extra buffers come
+  from the heap and the arena grows to the peak at the end of the outermost
+  scope, so a thread stops allocating after its first queries.
+*/
+class QueryWorkspace {
+public:
+  /*!
+    Gives back everything allocated from the workspace during its lifetime.
+  */
+  class Scope {
+  public:
+    explicit Scope(QueryWorkspace &workspace) : workspace_(workspace), mark_(workspace.used_) {
+      workspace.depth_++;
+    }
+    ~Scope() { workspace_.release(mark_); }
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    QueryWorkspace &workspace_;
+    size_t mark_;
+  };
+
+  QueryWorkspace() = default;
+  QueryWorkspace(const QueryWorkspace &) = delete;
+  QueryWorkspace &operator=(const QueryWorkspace &) = delete;
+
+  /*!
+    The workspace of the calling thread.
+  */
+  static QueryWorkspace &local();
+
+  /*!
+    Grows the arena to at least bytes. Has no effect while buffers are in use.
+  */
+  void reserve(size_t bytes);
+  size_t capacity() const { return arena_.size(); }
+
+  /*!
+    Most bytes in use at once in the workspaces of all threads, arena and heap
+    buffers alike, since the last call to reset_total_peak.
+  */
+  static size_t total_peak();
+  static void reset_total_peak();
+
+  /*!
+    Uninitialized room for count objects of type T, aligned to 64 bytes.
+  */
+  template <typename T> T *allocate(size_t count) {
+    return reinterpret_cast<T *>(allocate_bytes(count * sizeof(T)));
+  }
+
+  /*!
+    Selector matrices of the GSW dimensions, one per dimension, reused from one
+    query to the next.
+  */
+  std::vector<GSWMatrix> selectors;
+
+private:
+  uint8_t *allocate_bytes(size_t bytes);
+  void release(size_t mark);
+
+  utils::AlignedVector<uint8_t> arena_;
+  // Buffers that did not fit in the arena, kept until the outermost scope ends.
+  std::vector<utils::AlignedVector<uint8_t>> overflow_;
+  size_t used_ = 0;
+  // Number of open scopes. used_ is still 0 in an inner scope when everything
+  // before it went to the heap, so it cannot tell the outermost scope.
+  size_t depth_ = 0;
+  size_t overflow_bytes_ = 0;
+  size_t peak_ = 0;
+};
@@ -0,0 +1,36 @@
+#include "kernels.h"
+#include "database_constants.h"
+
+namespace kernels {
+namespace {
+
+template <size_t N, size_t Limbs, size_t L> constexpr KernelSet make_kernel_set() {
+  return {N, Limbs, L, &negacyclic_shift<N, Limbs>, &extract_digits<N, Limbs, L>};
+}
+
+// The shapes we deploy: the first level of the BFVDefault moduli for
+// PolyDegree, which has 2 limbs and is also the level the query is expanded
+// at, with the l used for the data and key GSW ciphertexts.
+constexpr size_t PolyDegree = DatabaseConstants::PolyDegree;
+const KernelSet specializations[] = {
+    make_kernel_set<PolyDegree, 2, 5>(),
+    make_kernel_set<PolyDegree, 2, 9>(),
+    make_kernel_set<PolyDegree, 2, 15>(),
+};
+
+const KernelSet generic_kernels = make_kernel_set<0, 0, 0>();
+
+} // namespace
+
+const KernelSet &select(size_t n, size_t limbs, size_t l) {
+  for (auto &kernels : specializations) {
+    if (kernels.n == n && kernels.limbs == limbs && kernels.l == l) {
+      return kernels;
+    }
+  }
+  return generic_kernels;
+}
+
+const KernelSet &generic() { return generic_kernels; }
+
+} // namespace kernels
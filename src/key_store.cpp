@@ -0,0 +1,440 @@
+#include "key_store.h"
+#include "utils.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+namespace {
+// On-disk format of the keys of one client, in native (little-endian) byte
+// order. The GSW key follows the header at gsw_offset as 2 * gsw_rows *
+// gsw_poly_size words in GSWMatrix order, then come the Galois elements of the
+// expansion keys as 32-bit words at galois_elts_offset and their keys, in the
+// layout of ExpansionKeys::data, at expansion_offset. Both word arrays start at
+// a multiple of KeyFileAlignment.
+constexpr char KeyFileMagic[8] = {'O', 'N', 'I', 'O', 'N', 'K', 'E', 'Y'};
+constexpr uint32_t KeyFileVersion = 2;
+constexpr uint64_t KeyFileAlignment = 64;
+
+struct KeyFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t gsw_rows; // 0 if the client has no GSW key
+  uint64_t gsw_poly_size;
+  uint64_t gsw_offset;
+  uint64_t galois_elt_count; // 0 if the client has no expansion keys
+  uint64_t galois_elts_offset;
+  uint64_t expansion_offset;
+  uint64_t expansion_size; // in words
+};
+
+uint64_t align(uint64_t offset) {
+  return (offset + KeyFileAlignment - 1) / KeyFileAlignment * KeyFileAlignment;
+}
+
+size_t gsw_words(const GSWMatrix &gsw) { return 2 * gsw.rows() * gsw.poly_size(); }
+
+size_t entry_bytes(const ExpansionKeys *expansion, const GSWMatrix *gsw) {
+  size_t bytes = 0;
+  if (expansion) {
+    bytes += expansion->galois_elts().size() * sizeof(uint32_t) +
+             expansion->size() * sizeof(uint64_t);
+  }
+  if (gsw) {
+    bytes += gsw_words(*gsw) * sizeof(uint64_t);
+  }
+  return bytes;
+}
+} // namespace
+
+ClientKeyStore::ClientKeyStore(std::shared_ptr<const seal::SEALContext> context,
+                               size_t memory_budget, std::string spill_dir)
+    : context_(std::move(context)), memory_budget_(memory_budget),
+      spill_dir_(std::move(spill_dir)) {}
+
+void ClientKeyStore::set_expansion_keys(uint32_t client_id, ExpansionKeys keys) {
+  auto expansion = std::make_shared<const ExpansionKeys>(std::move(keys));
+  update(client_id, [&](Entry &entry) { entry.expansion = expansion; });
+}
+
+void ClientKeyStore::set_gsw_key(uint32_t client_id, GSWMatrix key) {
+  auto gsw = std::make_shared<const GSWMatrix>(std::move(key));
+  update(client_id, [&](Entry &entry) { entry.gsw = gsw; });
+}
+
+std::shared_ptr<const ExpansionKeys> ClientKeyStore::expansion_keys(uint32_t client_id) {
+  auto entry = find(client_id);
+  return entry ? entry->expansion : nullptr;
+}
+
+std::shared_ptr<const GSWMatrix> ClientKeyStore::gsw_key(uint32_t client_id) {
+  auto entry = find(client_id);
+  return entry ? entry->gsw : nullptr;
+}
+
+// The file is removed under io_mutex, so that a spill of the client that was
+// started before the erase cannot recreate it afterwards.
+void ClientKeyStore::erase(uint32_t client_id) {
+  Shard &shard = shard_of(client_id);
+  std::lock_guard<std::mutex> io_lock(shard.io_mutex);
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    remove(shard, client_id);
+    shard.spilling.erase(client_id);
+    publish(shard, client_id, nullptr);
+    shard.generations[client_id]++;
+  }
+  if (!spill_dir_.empty()) {
+    std::remove(path(client_id).c_str());
+  }
+}
+
+KeyStoreStats ClientKeyStore::stats() const {
+  KeyStoreStats stats;
+  for (auto &hits : hits_) {
+    stats.hits += hits.value.load();
+  }
+  stats.misses = misses_.load();
+  stats.loads = loads_.load();
+  stats.evictions = evictions_.load();
+  stats.spill_failures = spill_failures_.load();
+  for (auto &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    stats.resident_clients += shard.ring.size();
+  }
+  stats.resident_bytes = resident_bytes_.load();
+  return stats;
+}
+
+std::shared_ptr<const ClientKeyStore::Entry> ClientKeyStore::find(uint32_t client_id) {
+  Shard &shard = shard_of(client_id);
+  if (auto entry = lookup(shard, client_id)) {
+    static thread_local const size_t counter =
+        std::hash<std::thread::id>()(std::this_thread::get_id()) % NumShards;
+    hits_[counter].value.fetch_add(1, std::memory_order_relaxed);
+    return entry;
+  }
+  misses_.fetch_add(1, std::memory_order_relaxed);
+  if (spill_dir_.empty()) {
+    return nullptr;
+  }
+
+  // No spill or erase of the shard can run while io_mutex is held, so the
+  // file read below is the last one written, and a client that is not in the
+  // index has no newer keys than it. A set of the client while the file is
+  // read makes the loaded keys stale, and the lookup is retried; sets and
+  // erases of other clients of the shard do not matter.
+  std::unique_lock<std::mutex> io_lock(shard.io_mutex);
+  std::shared_ptr<const Entry> loaded;
+  while (true) {
+    uint64_t seen;
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      if (auto entry = lookup(shard, client_id)) {
+        return entry;
+      }
+      seen = generation(shard, client_id);
+    }
+    loaded = load(client_id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (generation(shard, client_id) != seen) {
+      continue;
+    }
+    if (auto entry = lookup(shard, client_id)) {
+      return entry;
+    }
+    if (!loaded) {
+      return nullptr;
+    }
+    loads_.fetch_add(1, std::memory_order_relaxed);
+    insert(shard, client_id, loaded);
+    break;
+  }
+  io_lock.unlock();
+  evict(client_id);
+  return loaded;
+}
+
+// Retries when another set or erase of the client lands between reading its
+// current keys and publishing the new entry, so neither update is lost.
+void ClientKeyStore::update(uint32_t client_id, const std::function<void(Entry &)> &change) {
+  Shard &shard = shard_of(client_id);
+  while (true) {
+    uint64_t seen;
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      seen = generation(shard, client_id);
+    }
+    auto current = find(client_id);
+    auto entry = std::make_shared<Entry>();
+    if (current) {
+      entry->expansion = current->expansion;
+      entry->gsw = current->gsw;
+    }
+    change(*entry);
+    entry->bytes = entry_bytes(entry->expansion.get(), entry->gsw.get());
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      if (generation(shard, client_id) != seen) {
+        continue;
+      }
+      shard.generations[client_id]++;
+      insert(shard, client_id, std::move(entry));
+    }
+    evict(client_id);
+    return;
+  }
+}
+
+// Shards are visited round robin and each gives up one client chosen by its
+// CLOCK hand: a client whose reference bit is set gets it cleared and is
+// passed over once.
+void ClientKeyStore::evict(uint32_t keep) {
+  if (spill_dir_.empty()) {
+    return;
+  }
+  size_t idle_shards = 0;
+  while (resident_bytes_.load() > memory_budget_ && idle_shards < NumShards) {
+    Shard &shard = shards_[evict_hand_.fetch_add(1, std::memory_order_relaxed) % NumShards];
+    uint32_t victim_id = 0;
+    std::shared_ptr<const Entry> victim;
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      auto index = std::atomic_load(&shard.index);
+      for (size_t step = 0; step < 2 * shard.ring.size(); step++) {
+        if (shard.hand >= shard.ring.size()) {
+          shard.hand = 0;
+        }
+        uint32_t client_id = shard.ring[shard.hand];
+        const std::shared_ptr<const Entry> &entry = index->at(client_id);
+        if (client_id != keep && !entry->referenced.exchange(false)) {
+          victim_id = client_id;
+          victim = entry;
+          break;
+        }
+        shard.hand++;
+      }
+      if (!victim) {
+        idle_shards++;
+        continue;
+      }
+      remove(shard, victim_id);
+      if (victim->on_disk) {
+        publish(shard, victim_id, nullptr);
+      } else {
+        shard.spilling.insert(victim_id);
+      }
+    }
+    idle_shards = 0;
+    evictions_.fetch_add(1, std::memory_order_relaxed);
+    // The disk is unlikely to take the next client either, so eviction stops
+    // until the next update or load.
+    if (!victim->on_disk && !spill_evicted(shard, victim_id, std::move(victim))) {
+      spill_failures_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+  }
+}
+
+bool ClientKeyStore::spill_evicted(Shard &shard, uint32_t client_id,
+                                   std::shared_ptr<const Entry> entry) {
+  std::lock_guard<std::mutex> io_lock(shard.io_mutex);
+  auto still_spilling = [&] {
+    return shard.spilling.count(client_id) != 0 &&
+           std::atomic_load(&shard.index)->at(client_id) == entry;
+  };
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (!still_spilling()) {
+      return true;
+    }
+  }
+  try {
+    spill(client_id, *entry);
+  } catch (const std::exception &) {
+    // Keep the keys in memory rather than lose them.
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (still_spilling()) {
+      insert(shard, client_id, entry);
+    }
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if (still_spilling()) {
+    shard.spilling.erase(client_id);
+    publish(shard, client_id, nullptr);
+  }
+  return true;
+}
+
+std::shared_ptr<const ClientKeyStore::Entry> ClientKeyStore::lookup(const Shard &shard,
+                                                                    uint32_t client_id) {
+  auto index = std::atomic_load(&shard.index);
+  auto it = index->find(client_id);
+  if (it == index->end()) {
+    return nullptr;
+  }
+  const Entry &entry = *it->second;
+  // Only written when clear, so hot entries do not bounce between caches.
+  if (!entry.referenced.load(std::memory_order_relaxed)) {
+    entry.referenced.store(true, std::memory_order_relaxed);
+  }
+  return it->second;
+}
+
+uint64_t ClientKeyStore::generation(const Shard &shard, uint32_t client_id) {
+  auto it = shard.generations.find(client_id);
+  return it != shard.generations.end() ? it->second : 0;
+}
+
+void ClientKeyStore::publish(Shard &shard, uint32_t client_id,
+                             std::shared_ptr<const Entry> entry) {
+  auto index = std::make_shared<Index>(*std::atomic_load(&shard.index));
+  if (entry) {
+    (*index)[client_id] = std::move(entry);
+  } else {
+    index->erase(client_id);
+  }
+  std::atomic_store(&shard.index, std::shared_ptr<const Index>(std::move(index)));
+}
+
+// A new entry supersedes one waiting to be spilled.
+void ClientKeyStore::insert(Shard &shard, uint32_t client_id,
+                            std::shared_ptr<const Entry> entry) {
+  auto it = shard.ring_pos.find(client_id);
+  if (it != shard.ring_pos.end()) {
+    resident_bytes_.fetch_sub(std::atomic_load(&shard.index)->at(client_id)->bytes);
+  } else {
+    shard.ring_pos.emplace(client_id, shard.ring.size());
+    shard.ring.push_back(client_id);
+  }
+  shard.spilling.erase(client_id);
+  resident_bytes_.fetch_add(entry->bytes);
+  publish(shard, client_id, std::move(entry));
+}
+
+// The last client of the ring takes the place of the removed one.
+void ClientKeyStore::remove(Shard &shard, uint32_t client_id) {
+  auto it = shard.ring_pos.find(client_id);
+  if (it == shard.ring_pos.end()) {
+    return;
+  }
+  size_t pos = it->second;
+  shard.ring_pos.erase(it);
+  resident_bytes_.fetch_sub(std::atomic_load(&shard.index)->at(client_id)->bytes);
+  uint32_t moved = shard.ring.back();
+  shard.ring[pos] = moved;
+  shard.ring.pop_back();
+  if (moved != client_id) {
+    shard.ring_pos[moved] = pos;
+  }
+}
+
+std::shared_ptr<ClientKeyStore::Entry> ClientKeyStore::load(uint32_t client_id) const {
+  if (spill_dir_.empty()) {
+    return nullptr;
+  }
+  std::string file_path = path(client_id);
+  struct stat st;
+  if (stat(file_path.c_str(), &st) != 0) {
+    return nullptr;
+  }
+
+  utils::MappedFile file(file_path);
+  KeyFileHeader header;
+  if (file.size() < sizeof(header)) {
+    throw std::runtime_error(file_path + " is not an OnionPIR key file");
+  }
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (std::memcmp(header.magic, KeyFileMagic, sizeof(header.magic)) != 0 ||
+      header.version != KeyFileVersion) {
+    throw std::runtime_error(file_path + " is not an OnionPIR key file");
+  }
+  size_t gsw_bytes = 2 * header.gsw_rows * header.gsw_poly_size * sizeof(uint64_t);
+  size_t elts_bytes = header.galois_elt_count * sizeof(uint32_t);
+  size_t expansion_bytes = header.expansion_size * sizeof(uint64_t);
+  if (header.gsw_offset + gsw_bytes > file.size() ||
+      header.galois_elts_offset + elts_bytes > file.size() ||
+      header.expansion_offset + expansion_bytes > file.size()) {
+    throw std::runtime_error(file_path + " is truncated");
+  }
+
+  auto entry = std::make_shared<Entry>();
+  entry->on_disk = true;
+  if (header.gsw_rows != 0) {
+    auto gsw = std::make_shared<GSWMatrix>(header.gsw_rows, header.gsw_poly_size);
+    std::memcpy(gsw->poly(0, 0), file.data() + header.gsw_offset, gsw_bytes);
+    entry->gsw = std::move(gsw);
+  }
+  if (header.galois_elt_count != 0) {
+    std::vector<uint32_t> galois_elts(header.galois_elt_count);
+    std::memcpy(galois_elts.data(), file.data() + header.galois_elts_offset, elts_bytes);
+    entry->expansion = std::make_shared<ExpansionKeys>(
+        context_, std::move(galois_elts),
+        reinterpret_cast<const uint64_t *>(file.data() + header.expansion_offset),
+        header.expansion_size);
+  }
+  entry->bytes = entry_bytes(entry->expansion.get(), entry->gsw.get());
+  return entry;
+}
+
+// The file is written under a temporary name and renamed, so a crash leaves
+// either the old keys or the new ones.
+void ClientKeyStore::spill(uint32_t client_id, const Entry &entry) const {
+  std::string file_path = path(client_id);
+  std::string tmp_path = file_path + ".tmp";
+  std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    throw std::runtime_error("Cannot open " + tmp_path + " for writing");
+  }
+
+  KeyFileHeader header{};
+  std::memcpy(header.magic, KeyFileMagic, sizeof(header.magic));
+  header.version = KeyFileVersion;
+  header.header_size = sizeof(KeyFileHeader);
+  header.gsw_offset = align(sizeof(KeyFileHeader));
+  uint64_t offset = header.gsw_offset;
+  // Pads the file with zeros up to position.
+  auto pad_to = [&](uint64_t position) {
+    std::vector<char> padding(position - static_cast<uint64_t>(out.tellp()), 0);
+    out.write(padding.data(), padding.size());
+  };
+  pad_to(offset);
+  if (entry.gsw) {
+    header.gsw_rows = entry.gsw->rows();
+    header.gsw_poly_size = entry.gsw->poly_size();
+    size_t gsw_bytes = gsw_words(*entry.gsw) * sizeof(uint64_t);
+    out.write(reinterpret_cast<const char *>(entry.gsw->poly(0, 0)), gsw_bytes);
+    offset += gsw_bytes;
+  }
+  if (entry.expansion) {
+    auto &galois_elts = entry.expansion->galois_elts();
+    header.galois_elt_count = galois_elts.size();
+    header.galois_elts_offset = align(offset);
+    header.expansion_offset =
+        align(header.galois_elts_offset + galois_elts.size() * sizeof(uint32_t));
+    header.expansion_size = entry.expansion->size();
+    pad_to(header.galois_elts_offset);
+    out.write(reinterpret_cast<const char *>(galois_elts.data()),
+              galois_elts.size() * sizeof(uint32_t));
+    pad_to(header.expansion_offset);
+    out.write(reinterpret_cast<const char *>(entry.expansion->data()),
+              entry.expansion->size() * sizeof(uint64_t));
+  }
+  out.seekp(0);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.close();
+  if (!out || std::rename(tmp_path.c_str(), file_path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+    throw std::runtime_error("Cannot write " + file_path);
+  }
+}
+
+std::string ClientKeyStore::path(uint32_t client_id) const {
+  return spill_dir_ + "/" + std::to_string(client_id) + ".keys";
+}
@@ -1,9 +1,35 @@
 #include "pir.h"
 
+#include <algorithm>
 #include <cassert>
+#include <mutex>
+
+std::shared_ptr<const seal::SEALContext>
+shared_seal_context(const seal::EncryptionParameters &params) {
+  // A process only uses a handful of parameter sets, so a list is enough.
+  static std::mutex mutex;
+  static std::vector<std::weak_ptr<const seal::SEALContext>> contexts;
+  std::lock_guard<std::mutex> lock(mutex);
+  contexts.erase(std::remove_if(contexts.begin(), contexts.end(),
+                                [](const auto &weak) { return weak.expired(); }),
+                 contexts.end());
+  for (auto &weak : contexts) {
+    auto context = weak.lock();
+    if (context && context->key_context_data()->parms() == params) {
+      return context;
+    }
+  }
+  auto context = std::make_shared<const seal::SEALContext>(params);
+  contexts.push_back(context);
+  return context;
+}
 
 seal::EncryptionParameters PirParams::get_seal_params() const { return seal_params_; }
 
+const GSWEval &PirParams::get_data_gsw() const { return data_gsw_; }
+
+const GSWEval &PirParams::get_key_gsw() const { return key_gsw_; }
+
 uint64_t PirParams::get_DBSize() const { return DBSize_; }
 
 std::vector<uint64_t> PirParams::get_dims() const { return dims_; }
@@ -21,8 +47,13 @@ void PirParams::print_values() {
   std::cout << "  base_log2_                           = " << base_log2_ << std::endl;
   std::cout << "  entry_size_                          = " << entry_size_ << std::endl;
   std::cout << "  DBSize_ (num plaintexts in database) = " << DBSize_ << std::endl;
+  std::cout << "  entry packing                        = "
+            << (packing_ == EntryPacking::Dense ? "dense" : "aligned") << std::endl;
   std::cout << "  DBCapacity (max num of entries)      = "
-            << DBSize_ * get_num_entries_per_plaintext() << std::endl;
+            << (packing_ == EntryPacking::Dense
+                    ? DBSize_ * get_num_bytes_per_plaintext() / entry_size_
+                    : DBSize_ * get_num_entries_per_plaintext())
+            << std::endl;
   std::cout << "  dimensions_                          = [ ";
 
   for (const auto &dim : dims_) {
@@ -66,6 +97,38 @@ size_t PirParams::get_num_bits_per_plaintext() const {
   return get_num_bits_per_coeff() * seal_params_.poly_modulus_degree();
 }
 
+size_t PirParams::get_num_bytes_per_plaintext() const { return get_num_bits_per_plaintext() / 8; }
+
+EntryPacking PirParams::get_entry_packing() const { return packing_; }
+
+size_t PirParams::get_entry_byte_offset(size_t entry_index) const {
+  if (packing_ == EntryPacking::Dense) {
+    return entry_index * entry_size_;
+  }
+  size_t num_entries_per_plaintext = get_num_entries_per_plaintext();
+  return entry_index / num_entries_per_plaintext * get_num_bytes_per_plaintext() +
+         entry_index % num_entries_per_plaintext * entry_size_;
+}
+
+std::pair<size_t, size_t> PirParams::get_entry_plaintexts(size_t entry_index) const {
+  size_t bytes_per_plaintext = get_num_bytes_per_plaintext();
+  size_t begin = get_entry_byte_offset(entry_index);
+  size_t first = begin / bytes_per_plaintext;
+  size_t last = (begin + entry_size_ - 1) / bytes_per_plaintext;
+  return {first, last - first + 1};
+}
+
+std::pair<size_t, size_t> PirParams::get_plaintext_entries(size_t plaintext_index) const {
+  if (packing_ == EntryPacking::Aligned) {
+    size_t num_entries_per_plaintext = get_num_entries_per_plaintext();
+    return {plaintext_index * num_entries_per_plaintext,
+            (plaintext_index + 1) * num_entries_per_plaintext};
+  }
+  size_t bytes_per_plaintext = get_num_bytes_per_plaintext();
+  return {plaintext_index * bytes_per_plaintext / entry_size_,
+          ((plaintext_index + 1) * bytes_per_plaintext + entry_size_ - 1) / entry_size_};
+}
+
 void print_entry(Entry entry) {
   int cnt = 0;
   for (auto &val : entry) {
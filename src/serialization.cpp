@@ -0,0 +1,401 @@
+#include "serialization.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+namespace serialization {
+namespace {
+
+constexpr char WireMagic[4] = {'O', 'P', 'I', 'R'};
+
+// The words of a Params payload: the arguments of the PirParams constructor,
+// then the poly modulus degree, the plain modulus, the number of coefficient
+// moduli and the moduli themselves.
+std::vector<uint64_t> params_words(const PirParams &params) {
+  auto seal_params = params.get_seal_params();
+  auto &coeff_modulus = seal_params.coeff_modulus();
+  std::vector<uint64_t> words = {params.get_DBSize(),
+                                 params.get_dims().size(),
+                                 params.get_num_entries(),
+                                 params.get_entry_size(),
+                                 params.get_l(),
+                                 params.get_key_gsw().l,
+                                 static_cast<uint64_t>(params.get_entry_packing()),
+                                 seal_params.poly_modulus_degree(),
+                                 seal_params.plain_modulus().value(),
+                                 coeff_modulus.size()};
+  for (auto &modulus : coeff_modulus) {
+    words.push_back(modulus.value());
+  }
+  return words;
+}
+constexpr size_t ParamsFixedWords = 10;
+constexpr uint64_t MaxParamsDBSize = uint64_t(1) << 40;
+constexpr uint64_t MaxParamsL = 64;
+
+// Reads the header at data and checks that the whole message is there.
+MessageHeader read_header(const uint8_t *data, size_t size) {
+  MessageHeader header;
+  if (size < sizeof(header)) {
+    throw std::runtime_error("Truncated message header");
+  }
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.magic, WireMagic, sizeof(header.magic)) != 0) {
+    throw std::runtime_error("Not an OnionPIR message");
+  }
+  if (header.version != WireVersion) {
+    throw std::runtime_error("Unsupported message version " + std::to_string(header.version));
+  }
+  if (header.payload_size > size - sizeof(header)) {
+    throw std::runtime_error("Truncated message payload");
+  }
+  return header;
+}
+
+size_t packed_size(size_t count, int bits) { return (count * bits + 7) / 8; }
+
+// Writes count values of bits bits each as one little-endian bit stream.
+uint8_t *pack(const uint64_t *values, size_t count, int bits, uint8_t *out) {
+  uint128_t buffer = 0;
+  int filled = 0;
+  for (size_t i = 0; i < count; i++) {
+    buffer |= static_cast<uint128_t>(values[i]) << filled;
+    filled += bits;
+    if (filled >= 64) {
+      uint64_t word = static_cast<uint64_t>(buffer);
+      std::memcpy(out, &word, sizeof(word));
+      out += sizeof(word);
+      buffer >>= 64;
+      filled -= 64;
+    }
+  }
+  for (; filled > 0; filled -= 8) {
+    *out++ = static_cast<uint8_t>(buffer);
+    buffer >>= 8;
+  }
+  return out;
+}
+
+// Reads back what pack wrote. Returns false if a value is not below q.
+bool unpack(const uint8_t *in, size_t count, int bits, uint64_t q, uint64_t *values) {
+  const uint8_t *end = in + packed_size(count, bits);
+  const uint64_t mask = bits == 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1;
+  uint128_t buffer = 0;
+  int filled = 0;
+  bool valid = true;
+  for (size_t i = 0; i < count; i++) {
+    if (filled < bits) {
+      uint64_t word = 0;
+      size_t bytes = std::min<size_t>(sizeof(word), end - in);
+      std::memcpy(&word, in, bytes);
+      in += bytes;
+      buffer |= static_cast<uint128_t>(word) << filled;
+      filled += 8 * bytes;
+    }
+    values[i] = static_cast<uint64_t>(buffer) & mask;
+    valid &= values[i] < q;
+    buffer >>= bits;
+    filled -= bits;
+  }
+  return valid;
+}
+
+size_t packed_poly_size(size_t coeff_count, const std::vector<seal::Modulus> &coeff_modulus) {
+  size_t size = 0;
+  for (auto &modulus : coeff_modulus) {
+    size += packed_size(coeff_count, modulus.bit_count());
+  }
+  return size;
+}
+
+uint8_t *pack_poly(const uint64_t *poly, size_t coeff_count,
+                   const std::vector<seal::Modulus> &coeff_modulus, uint8_t *out) {
+  for (size_t j = 0; j < coeff_modulus.size(); j++) {
+    out = pack(poly + j * coeff_count, coeff_count, coeff_modulus[j].bit_count(), out);
+  }
+  return out;
+}
+
+const uint8_t *unpack_poly(const uint8_t *in, size_t coeff_count,
+                           const std::vector<seal::Modulus> &coeff_modulus, uint64_t *poly) {
+  for (size_t j = 0; j < coeff_modulus.size(); j++) {
+    int bits = coeff_modulus[j].bit_count();
+    if (!unpack(in, coeff_count, bits, coeff_modulus[j].value(), poly + j * coeff_count)) {
+      throw std::runtime_error("Coefficient out of range in message");
+    }
+    in += packed_size(coeff_count, bits);
+  }
+  return in;
+}
+
+// The level of the context whose ciphertexts have coeff_mod_count moduli.
+std::shared_ptr<const seal::SEALContext::ContextData>
+level_with(const seal::SEALContext &context, size_t coeff_mod_count) {
+  for (auto data = context.first_context_data(); data; data = data->next_context_data()) {
+    if (data->parms().coeff_modulus().size() == coeff_mod_count) {
+      return data;
+    }
+  }
+  throw std::runtime_error("No level with " + std::to_string(coeff_mod_count) + " moduli");
+}
+
+// FNV-1a.
+uint64_t hash_words(const std::vector<uint64_t> &words) {
+  uint64_t hash = 14695981039346656037ULL;
+  auto bytes = reinterpret_cast<const uint8_t *>(words.data());
+  for (size_t i = 0; i < words.size() * sizeof(uint64_t); i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+void write_header(MessageType type, uint64_t digest, uint64_t payload_size, uint8_t *out) {
+  MessageHeader header{};
+  std::memcpy(header.magic, WireMagic, sizeof(header.magic));
+  header.version = WireVersion;
+  header.type = static_cast<uint16_t>(type);
+  header.params_digest = digest;
+  header.payload_size = payload_size;
+  std::memcpy(out, &header, sizeof(header));
+}
+
+} // namespace
+
+uint64_t params_digest(const PirParams &params) { return hash_words(params_words(params)); }
+
+void write_params(const PirParams &params, std::vector<uint8_t> &out) {
+  auto words = params_words(params);
+  size_t payload_size = words.size() * sizeof(uint64_t);
+  size_t offset = out.size();
+  out.resize(offset + sizeof(MessageHeader) + payload_size);
+  write_header(MessageType::Params, hash_words(words), payload_size, out.data() + offset);
+  std::memcpy(out.data() + offset + sizeof(MessageHeader), words.data(), payload_size);
+}
+
+PirParams read_params(const uint8_t *data, size_t size) {
+  MessageHeader header = read_header(data, size);
+  if (header.type != static_cast<uint16_t>(MessageType::Params)) {
+    throw std::runtime_error("Expected a Params message");
+  }
+  if (header.payload_size % sizeof(uint64_t) != 0 ||
+      header.payload_size < ParamsFixedWords * sizeof(uint64_t)) {
+    throw std::runtime_error("Malformed Params message");
+  }
+  std::vector<uint64_t> words(header.payload_size / sizeof(uint64_t));
+  std::memcpy(words.data(), data + sizeof(header), header.payload_size);
+  uint64_t db_size = words[0], ndim = words[1], num_entries = words[2], entry_size = words[3];
+  uint64_t l = words[4], l_key = words[5], packing = words[6];
+  // Bounds that keep the arithmetic of the PirParams constructor in range; it
+  // checks the rest.
+  bool in_range = db_size != 0 && db_size <= MaxParamsDBSize && ndim != 0 && ndim < 64 &&
+                  num_entries != 0 && entry_size != 0 &&
+                  num_entries <= std::numeric_limits<uint64_t>::max() / entry_size && l != 0 &&
+                  l <= MaxParamsL && l_key != 0 && l_key <= MaxParamsL &&
+                  packing <= static_cast<uint64_t>(EntryPacking::Dense);
+  if (!in_range) {
+    throw std::runtime_error("Malformed Params message");
+  }
+
+  std::unique_ptr<PirParams> params;
+  try {
+    params = std::make_unique<PirParams>(db_size, ndim, num_entries, entry_size, l, l_key,
+                                         static_cast<EntryPacking>(packing));
+  } catch (const std::invalid_argument &) {
+    throw std::runtime_error("Malformed Params message");
+  }
+  if (params_words(*params) != words || params_digest(*params) != header.params_digest) {
+    throw std::runtime_error("The parameters of the server cannot be built here");
+  }
+  return *params;
+}
+
+MessageWriter::MessageWriter(const PirParams &params, std::vector<uint8_t> &out)
+    : context_(params.get_data_gsw().context), digest_(params_digest(params)), out_(out) {}
+
+uint8_t *MessageWriter::begin_message(MessageType type, size_t payload_size) {
+  size_t offset = out_.size();
+  out_.resize(offset + sizeof(MessageHeader) + payload_size);
+  write_header(type, digest_, payload_size, out_.data() + offset);
+  return out_.data() + offset + sizeof(MessageHeader);
+}
+
+// SEAL only bounds the size up front, so the message is shrunk to what was
+// written.
+template <typename T> void MessageWriter::write_seal_object(MessageType type, const T &object) {
+  size_t bound = static_cast<size_t>(object.save_size());
+  size_t offset = out_.size();
+  uint8_t *payload = begin_message(type, bound);
+  uint64_t written =
+      static_cast<uint64_t>(object.save(reinterpret_cast<seal::seal_byte *>(payload), bound));
+  out_.resize(offset + sizeof(MessageHeader) + written);
+  std::memcpy(out_.data() + offset + offsetof(MessageHeader, payload_size), &written,
+              sizeof(written));
+}
+
+void MessageWriter::write_query(const PirQuery &query) {
+  write_seal_object(MessageType::Query, query);
+}
+
+void MessageWriter::write_galois_keys(const seal::GaloisKeys &keys) {
+  write_seal_object(MessageType::GaloisKeys, keys);
+}
+
+void MessageWriter::write_galois_keys(const seal::Serializable<seal::GaloisKeys> &keys) {
+  write_seal_object(MessageType::GaloisKeys, keys);
+}
+
+void MessageWriter::write_gsw_key(const GSWMatrix &key) {
+  auto &parms = context_->first_context_data()->parms();
+  size_t coeff_count = parms.poly_modulus_degree();
+  auto &coeff_modulus = parms.coeff_modulus();
+  if (key.poly_size() != coeff_count * coeff_modulus.size()) {
+    throw std::invalid_argument("GSW key does not match the parameters");
+  }
+  size_t poly_bytes = packed_poly_size(coeff_count, coeff_modulus);
+  uint8_t *out = begin_message(MessageType::GSWKey, 2 * sizeof(uint64_t) +
+                                                        2 * key.rows() * poly_bytes);
+  uint64_t shape[2] = {key.rows(), key.poly_size()};
+  std::memcpy(out, shape, sizeof(shape));
+  out += sizeof(shape);
+  for (size_t col = 0; col < 2; col++) {
+    for (size_t row = 0; row < key.rows(); row++) {
+      out = pack_poly(key.poly(row, col), coeff_count, coeff_modulus, out);
+    }
+  }
+}
+
+void MessageWriter::write_response(const std::vector<seal::Ciphertext> &reply) {
+  size_t payload_size = sizeof(uint64_t);
+  for (auto &ct : reply) {
+    auto &parms = context_->get_context_data(ct.parms_id())->parms();
+    payload_size += sizeof(CiphertextHeader) +
+                    ct.size() * packed_poly_size(parms.poly_modulus_degree(),
+                                                 parms.coeff_modulus());
+  }
+  uint8_t *out = begin_message(MessageType::Response, payload_size);
+  uint64_t count = reply.size();
+  std::memcpy(out, &count, sizeof(count));
+  out += sizeof(count);
+  for (auto &ct : reply) {
+    auto &parms = context_->get_context_data(ct.parms_id())->parms();
+    size_t coeff_count = parms.poly_modulus_degree();
+    auto &coeff_modulus = parms.coeff_modulus();
+    CiphertextHeader header{};
+    header.size = ct.size();
+    header.coeff_mod_count = coeff_modulus.size();
+    header.ntt_form = ct.is_ntt_form();
+    std::memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+    for (size_t k = 0; k < ct.size(); k++) {
+      out = pack_poly(ct.data(k), coeff_count, coeff_modulus, out);
+    }
+  }
+}
+
+MessageReader::MessageReader(const PirParams &params, const uint8_t *data, size_t size)
+    : context_(params.get_data_gsw().context), digest_(params_digest(params)), data_(data),
+      size_(size) {}
+
+MessageType MessageReader::next_type() const {
+  return static_cast<MessageType>(read_header(data_ + offset_, size_ - offset_).type);
+}
+
+const uint8_t *MessageReader::next_payload(MessageType type, size_t &payload_size) {
+  MessageHeader header = read_header(data_ + offset_, size_ - offset_);
+  if (header.type != static_cast<uint16_t>(type)) {
+    throw std::runtime_error("Unexpected message type " + std::to_string(header.type));
+  }
+  if (header.params_digest != digest_) {
+    throw std::runtime_error("Message was made for other parameters");
+  }
+  const uint8_t *payload = data_ + offset_ + sizeof(header);
+  payload_size = header.payload_size;
+  offset_ += sizeof(header) + payload_size;
+  return payload;
+}
+
+void MessageReader::read_query(PirQuery &query) {
+  size_t payload_size;
+  const uint8_t *payload = next_payload(MessageType::Query, payload_size);
+  query.load(*context_, reinterpret_cast<const seal::seal_byte *>(payload), payload_size);
+}
+
+void MessageReader::read_galois_keys(seal::GaloisKeys &keys) {
+  size_t payload_size;
+  const uint8_t *payload = next_payload(MessageType::GaloisKeys, payload_size);
+  keys.load(*context_, reinterpret_cast<const seal::seal_byte *>(payload), payload_size);
+}
+
+void MessageReader::read_gsw_key(GSWMatrix &key) {
+  size_t payload_size;
+  const uint8_t *payload = next_payload(MessageType::GSWKey, payload_size);
+  auto &parms = context_->first_context_data()->parms();
+  size_t coeff_count = parms.poly_modulus_degree();
+  auto &coeff_modulus = parms.coeff_modulus();
+  size_t poly_bytes = packed_poly_size(coeff_count, coeff_modulus);
+
+  uint64_t shape[2];
+  if (payload_size < sizeof(shape)) {
+    throw std::runtime_error("Malformed GSWKey message");
+  }
+  std::memcpy(shape, payload, sizeof(shape));
+  uint64_t rows = shape[0];
+  if (shape[1] != coeff_count * coeff_modulus.size() ||
+      rows > (payload_size - sizeof(shape)) / (2 * poly_bytes) ||
+      sizeof(shape) + 2 * rows * poly_bytes != payload_size) {
+    throw std::runtime_error("Malformed GSWKey message");
+  }
+  const uint8_t *in = payload + sizeof(shape);
+  key.resize(rows, shape[1]);
+  for (size_t col = 0; col < 2; col++) {
+    for (size_t row = 0; row < rows; row++) {
+      in = unpack_poly(in, coeff_count, coeff_modulus, key.poly(row, col));
+    }
+  }
+}
+
+void MessageReader::read_response(std::vector<seal::Ciphertext> &reply) {
+  size_t payload_size;
+  const uint8_t *in = next_payload(MessageType::Response, payload_size);
+  const uint8_t *end = in + payload_size;
+  uint64_t count;
+  if (payload_size < sizeof(count)) {
+    throw std::runtime_error("Malformed Response message");
+  }
+  std::memcpy(&count, in, sizeof(count));
+  in += sizeof(count);
+  if (count > static_cast<size_t>(end - in) / sizeof(CiphertextHeader)) {
+    throw std::runtime_error("Malformed Response message");
+  }
+  reply.resize(count);
+  for (auto &ct : reply) {
+    CiphertextHeader header;
+    if (static_cast<size_t>(end - in) < sizeof(header)) {
+      throw std::runtime_error("Malformed Response message");
+    }
+    std::memcpy(&header, in, sizeof(header));
+    in += sizeof(header);
+    auto context_data = level_with(*context_, header.coeff_mod_count);
+    auto &parms = context_data->parms();
+    size_t coeff_count = parms.poly_modulus_degree();
+    auto &coeff_modulus = parms.coeff_modulus();
+    size_t poly_bytes = packed_poly_size(coeff_count, coeff_modulus);
+    if (header.size < 2 || header.size > static_cast<size_t>(end - in) / poly_bytes) {
+      throw std::runtime_error("Malformed Response message");
+    }
+    ct.resize(*context_, context_data->parms_id(), header.size);
+    ct.is_ntt_form() = header.ntt_form != 0;
+    for (size_t k = 0; k < header.size; k++) {
+      in = unpack_poly(in, coeff_count, coeff_modulus, ct.data(k));
+    }
+  }
+  if (in != end) {
+    throw std::runtime_error("Malformed Response message");
+  }
+}
+
+} // namespace serialization
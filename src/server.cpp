@@ -1,15 +1,97 @@
 #include "server.h"
 #include "external_prod.h"
+#include "reduction.h"
 #include "utils.h"
+#include "workspace.h"
+#include <algorithm>
+#include <atomic>
 #include <bitset>
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
 #include <memory>
 #include <stdexcept>
 
+namespace {
+// On-disk format of a preprocessed database, in native (little-endian) byte
+// order. The header is followed, at tiles_offset, by the NTT database in the
+// tiled order of PirServer::build_tiles.
+constexpr char DatabaseFileMagic[8] = {'O', 'N', 'I', 'O', 'N', 'D', 'B', '\0'};
+constexpr uint32_t DatabaseFileVersion = 2;
+constexpr uint64_t DatabaseFileAlignment = 4096;
+
+struct DatabaseFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t parms_id[4]; // SEAL parms_id of the first context data
+  uint64_t poly_modulus_degree;
+  uint64_t coeff_mod_count;
+  uint64_t plain_modulus;
+  uint64_t db_size;
+  uint64_t num_dims;
+  uint64_t first_dim;
+  uint64_t num_entries;
+  uint64_t entry_size;
+  uint64_t entry_packing; // EntryPacking, which decides the entry of each byte
+  uint64_t tile_coeffs;
+  uint64_t tiles_offset;
+  uint64_t tiles_size; // in bytes
+  uint64_t checksum;   // utils::checksum64 of the tiles
+};
+
+size_t ciphertext_bytes(const seal::Ciphertext &ct) {
+  return ct.size() * ct.poly_modulus_degree() * ct.coeff_modulus_size() * sizeof(uint64_t);
+}
+
+size_t ciphertext_bytes(const std::vector<seal::Ciphertext> &cts) {
+  size_t bytes = 0;
+  for (const seal::Ciphertext &ct : cts) {
+    bytes += ciphertext_bytes(ct);
+  }
+  return bytes;
+}
+} // namespace
+
 PirServer::PirServer(const PirParams &pir_params)
     : pir_params_(pir_params), context_(pir_params.get_seal_params()),
-      DBSize_(pir_params.get_DBSize()), evaluator_(context_), dims_(pir_params.get_dims()) {}
+      DBSize_(pir_params.get_DBSize()), evaluator_(context_), dims_(pir_params.get_dims()) {
+  set_num_threads(std::thread::hardware_concurrency());
+  key_store_ = std::make_shared<ClientKeyStore>(pir_params.get_data_gsw().context);
+
+  // The largest buffers a query takes from the calling thread's workspace: the
+  // decomposed rows of a batch of external products, or the 128-bit
+  // accumulator of a column of the first dimension.
+  auto &first_parms = context_.first_context_data()->parms();
+  size_t poly_size = first_parms.poly_modulus_degree() * first_parms.coeff_modulus().size();
+  size_t product_bytes = DatabaseConstants::ExternalProductBatch * 2 * pir_params.get_l() *
+                         poly_size * sizeof(uint64_t);
+  size_t first_dim_bytes = 2 * poly_size * sizeof(uint128_t);
+  workspace_bytes_ = std::max(product_bytes, first_dim_bytes) + 2 * poly_size * sizeof(uint64_t);
+  kernels_ = &kernels::select(first_parms.poly_modulus_degree(),
+                              first_parms.coeff_modulus().size(), pir_params.get_l());
+}
+
+void PirServer::set_num_threads(size_t num_threads) {
+  pool_ = std::make_shared<ThreadPool>(std::max<size_t>(num_threads, 1));
+}
+
+void PirServer::set_thread_pool(std::shared_ptr<ThreadPool> pool) {
+  if (!pool) {
+    throw std::invalid_argument("Thread pool must not be null");
+  }
+  pool_ = std::move(pool);
+}
+
+std::shared_ptr<ThreadPool> PirServer::get_thread_pool() const { return pool_; }
+
+size_t PirServer::get_num_threads() const { return pool_->size(); }
+
+void PirServer::set_database_layout(DatabaseLayout layout) { db_layout_ = layout; }
+
+void PirServer::set_expansion_mode(ExpansionMode mode) { expansion_mode_ = mode; }
 
 // Fills the database with random data
 void PirServer::gen_data() {
@@ -26,20 +108,24 @@ void PirServer::gen_data() {
 
 // this function will not function if there are missing entries in the database
 std::vector<seal::Ciphertext>
-PirServer::evaluate_first_dim(std::vector<seal::Ciphertext> &selection_vector) {
+PirServer::evaluate_first_dim(const DatabaseSnapshot &db,
+                              std::vector<seal::Ciphertext> &selection_vector) {
+  if (db.layout != DatabaseLayout::Plaintexts) {
+    throw std::logic_error("evaluate_first_dim requires the Plaintexts database layout");
+  }
   int size_of_other_dims = DBSize_ / dims_[0];
   std::vector<seal::Ciphertext> result;
 
   for (int i = 0; i < size_of_other_dims; i++) {
     seal::Ciphertext cipher_result;
-    evaluator_.multiply_plain(selection_vector[0], *db_[i], cipher_result);
+    evaluator_.multiply_plain(selection_vector[0], *db.plaintexts[i], cipher_result);
     result.push_back(cipher_result);
   }
 
   for (int i = 1; i < selection_vector.size(); i++) {
     for (int j = 0; j < size_of_other_dims; j++) {
       seal::Ciphertext cipher_result;
-      evaluator_.multiply_plain(selection_vector[i], *db_[i * size_of_other_dims + j],
+      evaluator_.multiply_plain(selection_vector[i], *db.plaintexts[i * size_of_other_dims + j],
                                 cipher_result);
       evaluator_.add_inplace(result[j], cipher_result);
     }
@@ -56,78 +142,308 @@ PirServer::evaluate_first_dim(std::vector<seal::Ciphertext> &selection_vector) {
 // first dimension with a delayed modulus optimization. Selection vector should
 // be transformed to ntt.
 std::vector<seal::Ciphertext>
-PirServer::evaluate_first_dim_delayed_mod(std::vector<seal::Ciphertext> &selection_vector) {
-  int size_of_other_dims = DBSize_ / dims_[0];
-  std::vector<seal::Ciphertext> result;
+PirServer::evaluate_first_dim_delayed_mod(const DatabaseSnapshot &db,
+                                          std::vector<seal::Ciphertext> &selection_vector) {
+  size_t size_of_other_dims = DBSize_ / dims_[0];
   auto seal_params = context_.get_context_data(selection_vector[0].parms_id())->parms();
   // auto seal_params =  context_.key_context_data()->parms();
   auto coeff_modulus = seal_params.coeff_modulus();
   size_t coeff_count = seal_params.poly_modulus_degree();
   size_t coeff_mod_count = coeff_modulus.size();
   size_t encrypted_ntt_size = selection_vector[0].size();
-  seal::Ciphertext ct_acc;
+  size_t poly_size = coeff_count * coeff_mod_count;
+  size_t acc_size = encrypted_ntt_size * poly_size;
+  auto multiply_poly_acum = utils::multiply_poly_acum_kernel(utils::max_bit_count(coeff_modulus));
+
+  pool_->parallel_for(0, dims_[0], [&](size_t i) {
+    if (!selection_vector[i].is_ntt_form()) {
+      evaluator_.transform_to_ntt_inplace(selection_vector[i]);
+    }
+  });
 
-  for (int i = 0; i < dims_[0]; i++) {
-    evaluator_.transform_to_ntt_inplace(selection_vector[i]);
+  if (db.layout == DatabaseLayout::Tiled) {
+    return evaluate_first_dim_tiled(db, selection_vector);
   }
 
-  for (int col_id = 0; col_id < size_of_other_dims; ++col_id) {
-    std::vector<std::vector<uint128_t>> buffer(
-        encrypted_ntt_size, std::vector<uint128_t>(coeff_count * coeff_mod_count, 0));
-    for (int i = 0; i < dims_[0]; i++) {
-      // std::cout << "i: " << i << std::endl;
+  // Adds rows [row_begin, row_end) of a column of the database, weighted by the
+  // selection vector, to a 128-bit accumulator.
+  auto accumulate_rows = [&](size_t col_id, size_t row_begin, size_t row_end,
+                             uint128_t *buffer) {
+    QueryWorkspace &workspace = QueryWorkspace::local();
+    QueryWorkspace::Scope scope(workspace);
+    uint64_t *scratch = workspace.allocate<uint64_t>(poly_size);
+    for (size_t i = row_begin; i < row_end; i++) {
+      const uint64_t *pt_ptr = ntt_plaintext(db, col_id + i * size_of_other_dims, scratch);
+      if (pt_ptr == nullptr) {
+        continue;
+      }
       for (size_t poly_id = 0; poly_id < encrypted_ntt_size; poly_id++) {
-        if (db_[col_id + i * size_of_other_dims].has_value()) {
-          utils::multiply_poly_acum(selection_vector[i].data(poly_id),
-                                    (*db_[col_id + i * size_of_other_dims]).data(),
-                                    coeff_count * coeff_mod_count, buffer[poly_id].data());
-        }
+        multiply_poly_acum(selection_vector[i].data(poly_id), pt_ptr, poly_size,
+                           buffer + poly_id * poly_size);
       }
     }
-    ct_acc = selection_vector[0];
+  };
+
+  // Reduces an accumulator into a ciphertext and takes it out of NTT form.
+  auto reducers = utils::make_reducers(coeff_modulus);
+  auto reduce = [&](const uint128_t *buffer, seal::Ciphertext &ct) {
     for (size_t poly_id = 0; poly_id < encrypted_ntt_size; poly_id++) {
-      auto ct_ptr = ct_acc.data(poly_id);
-      auto pt_ptr = buffer[poly_id];
-      for (int mod_id = 0; mod_id < coeff_mod_count; mod_id++) {
-        auto mod_idx = (mod_id * coeff_count);
-
-        for (int coeff_id = 0; coeff_id < coeff_count; coeff_id++) {
-          pt_ptr[coeff_id + mod_idx] =
-              pt_ptr[coeff_id + mod_idx] % static_cast<__uint128_t>(coeff_modulus[mod_id].value());
-          ct_ptr[coeff_id + mod_idx] = static_cast<uint64_t>(pt_ptr[coeff_id + mod_idx]);
-        }
+      auto ct_ptr = ct.data(poly_id);
+      auto pt_ptr = buffer + poly_id * poly_size;
+      for (size_t mod_id = 0; mod_id < coeff_mod_count; mod_id++) {
+        auto mod_idx = mod_id * coeff_count;
+        reducers[mod_id].reduce(pt_ptr + mod_idx, coeff_count, ct_ptr + mod_idx);
       }
     }
-    evaluator_.transform_from_ntt_inplace(ct_acc);
-    result.push_back(ct_acc);
+    evaluator_.transform_from_ntt_inplace(ct);
+  };
+
+  std::vector<seal::Ciphertext> result(size_of_other_dims, selection_vector[0]);
+
+  // When there are fewer columns than threads, the rows of each column are
+  // split into chunks as well. Each chunk gets its own accumulator and the
+  // accumulators of a column are summed before the reduction.
+  size_t num_row_chunks =
+      std::min<size_t>(dims_[0], (pool_->size() + size_of_other_dims - 1) / size_of_other_dims);
+  size_t rows_per_chunk = (dims_[0] + num_row_chunks - 1) / num_row_chunks;
+  num_row_chunks = (dims_[0] + rows_per_chunk - 1) / rows_per_chunk;
+
+  if (num_row_chunks == 1) {
+    pool_->parallel_for(0, size_of_other_dims, [&](size_t col_id) {
+      QueryWorkspace &workspace = QueryWorkspace::local();
+      QueryWorkspace::Scope scope(workspace);
+      uint128_t *buffer = workspace.allocate<uint128_t>(acc_size);
+      std::fill_n(buffer, acc_size, 0);
+      accumulate_rows(col_id, 0, dims_[0], buffer);
+      reduce(buffer, result[col_id]);
+    });
+    return result;
   }
 
+  // The partial accumulators are read by other tasks, so they live in the
+  // caller's workspace.
+  QueryWorkspace &workspace = QueryWorkspace::local();
+  QueryWorkspace::Scope scope(workspace);
+  size_t num_partial = size_of_other_dims * num_row_chunks;
+  uint128_t *partial = workspace.allocate<uint128_t>(num_partial * acc_size);
+  pool_->parallel_for(0, num_partial, [&](size_t task_id) {
+    size_t col_id = task_id / num_row_chunks;
+    size_t row_begin = (task_id % num_row_chunks) * rows_per_chunk;
+    size_t row_end = std::min<size_t>(dims_[0], row_begin + rows_per_chunk);
+    std::fill_n(partial + task_id * acc_size, acc_size, 0);
+    accumulate_rows(col_id, row_begin, row_end, partial + task_id * acc_size);
+  });
+  pool_->parallel_for(0, size_of_other_dims, [&](size_t col_id) {
+    uint128_t *buffer = partial + col_id * num_row_chunks * acc_size;
+    for (size_t chunk = 1; chunk < num_row_chunks; chunk++) {
+      const uint128_t *other = buffer + chunk * acc_size;
+      for (size_t k = 0; k < acc_size; k++) {
+        buffer[k] += other[k];
+      }
+    }
+    reduce(buffer, result[col_id]);
+  });
+
   return result;
 }
 
-std::vector<seal::Ciphertext> PirServer::evaluate_gsw_product(std::vector<seal::Ciphertext> &result,
-                                                              GSWCiphertext &selection_cipher) {
-  std::vector<seal::Ciphertext> result_vector;
-  auto block_size = result.size() / 2;
+// Same product as evaluate_first_dim_delayed_mod, computed one block of
+// TileCoeffs coefficients at a time. For a block, the selection vector tile of
+// every row stays in cache while each column's rows are streamed from
+// db.tiles, and the column accumulator fits in L1.
+std::vector<seal::Ciphertext>
+PirServer::evaluate_first_dim_tiled(const DatabaseSnapshot &db,
+                                    const std::vector<seal::Ciphertext> &selection_vector) {
+  const size_t tile = DatabaseConstants::TileCoeffs;
+  size_t num_rows = dims_[0];
+  size_t size_of_other_dims = DBSize_ / num_rows;
+  auto seal_params = context_.get_context_data(selection_vector[0].parms_id())->parms();
+  auto coeff_modulus = seal_params.coeff_modulus();
+  size_t coeff_count = seal_params.poly_modulus_degree();
+  size_t coeff_mod_count = coeff_modulus.size();
+  size_t encrypted_ntt_size = selection_vector[0].size();
+  size_t num_blocks = coeff_count * coeff_mod_count / tile;
+  auto multiply_poly_acum = utils::multiply_poly_acum_kernel(utils::max_bit_count(coeff_modulus));
+  auto reducers = utils::make_reducers(coeff_modulus);
 
-  for (int i = 0; i < block_size; i++) {
-    evaluator_.sub_inplace(result[i], result[i + block_size]);
-    data_gsw.external_product(selection_cipher, result[i], result[0].size(), result[i]);
-    result_vector.push_back(result[i]);
+  std::vector<seal::Ciphertext> result(size_of_other_dims, selection_vector[0]);
+
+  pool_->parallel_for(0, num_blocks, [&](size_t block_id) {
+    size_t offset = block_id * tile;
+    const utils::Reducer &reducer = reducers[offset / coeff_count];
+    const uint64_t *block_ptr = db.tiles_ptr + block_id * DBSize_ * tile;
+    QueryWorkspace &workspace = QueryWorkspace::local();
+    QueryWorkspace::Scope scope(workspace);
+    uint128_t *buffer = workspace.allocate<uint128_t>(encrypted_ntt_size * tile);
+
+    for (size_t col_id = 0; col_id < size_of_other_dims; col_id++) {
+      std::fill_n(buffer, encrypted_ntt_size * tile, 0);
+      const uint64_t *pt_ptr = block_ptr + col_id * num_rows * tile;
+      for (size_t i = 0; i < num_rows; i++, pt_ptr += tile) {
+        for (size_t poly_id = 0; poly_id < encrypted_ntt_size; poly_id++) {
+          multiply_poly_acum(selection_vector[i].data(poly_id) + offset, pt_ptr, tile,
+                             buffer + poly_id * tile);
+        }
+      }
+      for (size_t poly_id = 0; poly_id < encrypted_ntt_size; poly_id++) {
+        reducer.reduce(buffer + poly_id * tile, tile, result[col_id].data(poly_id) + offset);
+      }
+    }
+  });
+
+  pool_->parallel_for(0, size_of_other_dims, [&](size_t col_id) {
+    evaluator_.transform_from_ntt_inplace(result[col_id]);
+  });
+
+  return result;
+}
+
+// Evaluates the first dimension of several queries in one pass over the
+// database. Work is split into (column, coefficient block) tasks; each task
+// loads a block of every plaintext in the column once and multiplies it into
+// the accumulators of all the queries while it is in cache.
+std::vector<std::vector<seal::Ciphertext>>
+PirServer::evaluate_first_dim_batched(
+    const DatabaseSnapshot &db, std::vector<std::vector<seal::Ciphertext>> &selection_vectors) {
+  const size_t tile = DatabaseConstants::TileCoeffs;
+  size_t num_queries = selection_vectors.size();
+  size_t num_rows = dims_[0];
+  size_t size_of_other_dims = DBSize_ / num_rows;
+  auto seal_params = context_.get_context_data(selection_vectors[0][0].parms_id())->parms();
+  auto coeff_modulus = seal_params.coeff_modulus();
+  size_t coeff_count = seal_params.poly_modulus_degree();
+  size_t coeff_mod_count = coeff_modulus.size();
+  size_t encrypted_ntt_size = selection_vectors[0][0].size();
+  size_t num_blocks = coeff_count * coeff_mod_count / tile;
+  auto multiply_poly_acum = utils::multiply_poly_acum_kernel(utils::max_bit_count(coeff_modulus));
+  auto reducers = utils::make_reducers(coeff_modulus);
+
+  pool_->parallel_for(0, num_queries * num_rows, [&](size_t task_id) {
+    auto &ct = selection_vectors[task_id / num_rows][task_id % num_rows];
+    if (!ct.is_ntt_form()) {
+      evaluator_.transform_to_ntt_inplace(ct);
+    }
+  });
+
+  // Returns the block of the plaintext at (row, col), or nullptr if it is missing.
+  auto plaintext_block = [&](size_t row, size_t col_id, size_t block_id) -> const uint64_t * {
+    if (db.layout == DatabaseLayout::Tiled) {
+      return db.tiles_ptr + (block_id * DBSize_ + col_id * num_rows + row) * tile;
+    }
+    auto &plaintext = db.plaintexts[col_id + row * size_of_other_dims];
+    return plaintext.has_value() ? plaintext->data() + block_id * tile : nullptr;
+  };
+
+  std::vector<std::vector<seal::Ciphertext>> results(num_queries);
+  for (size_t q = 0; q < num_queries; q++) {
+    results[q].assign(size_of_other_dims, selection_vectors[q][0]);
   }
 
-  for (int j = 0; j < block_size; j++) {
-    data_gsw.cyphertext_inverse_ntt(result_vector[j]);
-    evaluator_.add_inplace(result_vector[j], result[j + block_size]);
+  // Compact plaintexts can only be transformed whole, so each task handles a
+  // full column and transforms each of its plaintexts once for all queries.
+  if (db.layout == DatabaseLayout::Compact) {
+    size_t poly_size = coeff_count * coeff_mod_count;
+    pool_->parallel_for(0, size_of_other_dims, [&](size_t col_id) {
+      QueryWorkspace &workspace = QueryWorkspace::local();
+      QueryWorkspace::Scope scope(workspace);
+      uint64_t *scratch = workspace.allocate<uint64_t>(poly_size);
+      size_t buffer_size = num_queries * encrypted_ntt_size * poly_size;
+      uint128_t *buffer = workspace.allocate<uint128_t>(buffer_size);
+      std::fill_n(buffer, buffer_size, 0);
+      for (size_t i = 0; i < num_rows; i++) {
+        const uint64_t *pt_ptr = ntt_plaintext(db, col_id + i * size_of_other_dims, scratch);
+        if (pt_ptr == nullptr) {
+          continue;
+        }
+        uint128_t *acc_ptr = buffer;
+        for (size_t q = 0; q < num_queries; q++) {
+          for (size_t poly_id = 0; poly_id < encrypted_ntt_size; poly_id++, acc_ptr += poly_size) {
+            multiply_poly_acum(selection_vectors[q][i].data(poly_id), pt_ptr, poly_size, acc_ptr);
+          }
+        }
+      }
+      const uint128_t *acc_ptr = buffer;
+      for (size_t q = 0; q < num_queries; q++) {
+        for (size_t poly_id = 0; poly_id < encrypted_ntt_size; poly_id++, acc_ptr += poly_size) {
+          auto ct_ptr = results[q][col_id].data(poly_id);
+          for (size_t mod_id = 0; mod_id < coeff_mod_count; mod_id++) {
+            reducers[mod_id].reduce(acc_ptr + mod_id * coeff_count, coeff_count,
+                                    ct_ptr + mod_id * coeff_count);
+          }
+        }
+        evaluator_.transform_from_ntt_inplace(results[q][col_id]);
+      }
+    });
+    return results;
   }
+
+  pool_->parallel_for(0, size_of_other_dims * num_blocks, [&](size_t task_id) {
+    size_t col_id = task_id / num_blocks;
+    size_t block_id = task_id % num_blocks;
+    size_t offset = block_id * tile;
+    const utils::Reducer &reducer = reducers[offset / coeff_count];
+    QueryWorkspace &workspace = QueryWorkspace::local();
+    QueryWorkspace::Scope scope(workspace);
+    uint128_t *buffer = workspace.allocate<uint128_t>(num_queries * encrypted_ntt_size * tile);
+    std::fill_n(buffer, num_queries * encrypted_ntt_size * tile, 0);
+
+    for (size_t i = 0; i < num_rows; i++) {
+      const uint64_t *pt_ptr = plaintext_block(i, col_id, block_id);
+      if (pt_ptr == nullptr) {
+        continue;
+      }
+      uint128_t *acc_ptr = buffer;
+      for (size_t q = 0; q < num_queries; q++) {
+        for (size_t poly_id = 0; poly_id < encrypted_ntt_size; poly_id++, acc_ptr += tile) {
+          multiply_poly_acum(selection_vectors[q][i].data(poly_id) + offset, pt_ptr, tile, acc_ptr);
+        }
+      }
+    }
+
+    const uint128_t *acc_ptr = buffer;
+    for (size_t q = 0; q < num_queries; q++) {
+      for (size_t poly_id = 0; poly_id < encrypted_ntt_size; poly_id++, acc_ptr += tile) {
+        reducer.reduce(acc_ptr, tile, results[q][col_id].data(poly_id) + offset);
+      }
+    }
+  });
+
+  pool_->parallel_for(0, num_queries * size_of_other_dims, [&](size_t task_id) {
+    evaluator_.transform_from_ntt_inplace(
+        results[task_id / size_of_other_dims][task_id % size_of_other_dims]);
+  });
+
+  return results;
+}
+
+std::vector<seal::Ciphertext> PirServer::evaluate_gsw_product(std::vector<seal::Ciphertext> &result,
+                                                              const GSWMatrix &selection_cipher) {
+  size_t block_size = result.size() / 2;
+  const GSWEval &data_gsw = pir_params_.get_data_gsw();
+
+  pool_->parallel_for(0, block_size, [&](size_t i) {
+    evaluator_.sub_inplace(result[i], result[i + block_size]);
+  });
+  data_gsw.external_product_batch(selection_cipher, result.data(), block_size, pool_.get());
+
+  std::vector<seal::Ciphertext> result_vector(block_size);
+  pool_->parallel_for(0, block_size, [&](size_t j) {
+    data_gsw.cyphertext_inverse_ntt(result[j]);
+    evaluator_.add_inplace(result[j], result[j + block_size]);
+    result_vector[j] = std::move(result[j]);
+  });
   return result_vector;
 }
 
 std::vector<seal::Ciphertext> PirServer::expand_query(uint32_t client_id,
                                                       seal::Ciphertext ciphertext) {
+  if (expansion_mode_ != ExpansionMode::Copy) {
+    return expand_query_inplace(client_id, ciphertext);
+  }
   seal::EncryptionParameters params = pir_params_.get_seal_params();
-  std::vector<Ciphertext> expanded_query;
   int poly_degree = params.poly_modulus_degree();
+  auto expansion_key_ptr = expansion_keys(client_id);
+  const ExpansionKeys &keys = *expansion_key_ptr;
 
   // Expand ciphertext into 2^expansion_factor individual ciphertexts (number of
   // bits)
@@ -139,105 +455,500 @@ std::vector<seal::Ciphertext> PirServer::expand_query(uint32_t client_id,
     expansion_factor++;
   }
 
-  std::vector<Ciphertext> cipher_vec((size_t)pow(2, expansion_factor));
+  // Leaf i descends from node i mod 2^a of level a, so only the first exp
+  // nodes of the tree lead to leaves that are used. Nodes past them are never
+  // computed and only the first exp ciphertexts are returned.
+  std::vector<Ciphertext> cipher_vec(exp);
   cipher_vec[0] = ciphertext;
 
   for (size_t a = 0; a < expansion_factor; a++) {
 
-    int expansion_const = pow(2, a);
+    size_t expansion_const = size_t(1) << a;
 
-    for (size_t b = 0; b < expansion_const; b++) {
+    // The nodes of a level are independent.
+    pool_->parallel_for(0, expansion_const, [&](size_t b) {
       Ciphertext cipher0 = cipher_vec[b];
-      evaluator_.apply_galois_inplace(cipher0, poly_degree / expansion_const + 1,
-                                      client_galois_keys_[client_id]);
-      Ciphertext cipher1;
-      utils::shift_polynomial(params, cipher0, cipher1, -expansion_const);
-      utils::shift_polynomial(params, cipher_vec[b], cipher_vec[b + expansion_const],
-                              -expansion_const);
+      keys.apply_galois(cipher0, poly_degree / expansion_const + 1, cipher0);
+      if (b + expansion_const < exp) {
+        Ciphertext cipher1;
+        utils::shift_polynomial(params, cipher0, cipher1, -expansion_const);
+        utils::shift_polynomial(params, cipher_vec[b], cipher_vec[b + expansion_const],
+                                -expansion_const);
+        evaluator_.sub_inplace(cipher_vec[b + expansion_const], cipher1);
+      }
       evaluator_.add_inplace(cipher_vec[b], cipher0);
-      evaluator_.sub_inplace(cipher_vec[b + expansion_const], cipher1);
-    }
+    });
+  }
+
+  return cipher_vec;
+}
+
+// Expanded ciphertexts are on the first level, which kernels_ is specialized
+// for; any other level falls back to the generic kernel.
+void PirServer::shift_inplace(seal::Ciphertext &ct, size_t shift,
+                              std::vector<uint64_t> &scratch) const {
+  auto &parms = context_.get_context_data(ct.parms_id())->parms();
+  size_t coeff_count = parms.poly_modulus_degree();
+  size_t coeff_mod_count = ct.coeff_modulus_size();
+  const kernels::KernelSet &shift_kernels =
+      kernels_->shifts(coeff_count, coeff_mod_count) ? *kernels_ : kernels::generic();
+  scratch.resize(coeff_count);
+  for (size_t i = 0; i < ct.size(); i++) {
+    shift_kernels.negacyclic_shift(ct.data(i), coeff_count, coeff_mod_count, shift,
+                                   parms.coeff_modulus().data(), scratch.data());
+  }
+}
+
+// Same tree as expand_query. A node ct with Galois image g has children
+// ct + g and x^-k * (ct - g), computed with evaluator_.sub into the
+// preallocated sibling and a shift in place instead of two shifted copies.
+// The key switch of ExpansionKeys needs coefficient form, so the tree stays in
+// coefficient form and only the first dimension leaves are transformed, on
+// the last level, while they are still in cache.
+std::vector<seal::Ciphertext> PirServer::expand_query_inplace(uint32_t client_id,
+                                                              const seal::Ciphertext &ciphertext) {
+  const seal::EncryptionParameters &params = context_.key_context_data()->parms();
+  size_t poly_degree = params.poly_modulus_degree();
+  auto expansion_key_ptr = expansion_keys(client_id);
+  const ExpansionKeys &keys = *expansion_key_ptr;
+
+  size_t exp = dims_[0] + pir_params_.get_l() * (dims_.size() - 1);
+  size_t expansion_factor = 0;
+  while ((size_t(1) << expansion_factor) < exp) {
+    expansion_factor++;
+  }
+
+  std::vector<seal::Ciphertext> cipher_vec(exp);
+  pool_->parallel_for(0, exp, [&](size_t i) {
+    cipher_vec[i].resize(context_, ciphertext.parms_id(), ciphertext.size());
+  });
+  cipher_vec[0] = ciphertext;
+
+  for (size_t a = 0; a < expansion_factor; a++) {
+    size_t expansion_const = size_t(1) << a;
+    uint32_t galois_elt = poly_degree / expansion_const + 1;
+    bool last_level = a + 1 == expansion_factor;
+
+    // Each task takes a contiguous run of nodes and reuses its scratch
+    // ciphertext and polynomial over them.
+    size_t nodes_per_task = (expansion_const + pool_->size() - 1) / pool_->size();
+    size_t num_tasks = (expansion_const + nodes_per_task - 1) / nodes_per_task;
+    pool_->parallel_for(0, num_tasks, [&](size_t task_id) {
+      seal::Ciphertext galois;
+      std::vector<uint64_t> scratch;
+      size_t end = std::min(expansion_const, (task_id + 1) * nodes_per_task);
+      for (size_t b = task_id * nodes_per_task; b < end; b++) {
+        keys.apply_galois(cipher_vec[b], galois_elt, galois);
+        size_t odd = b + expansion_const;
+        if (odd < exp) {
+          evaluator_.sub(cipher_vec[b], galois, cipher_vec[odd]);
+          shift_inplace(cipher_vec[odd], -expansion_const, scratch);
+          if (last_level && odd < dims_[0]) {
+            evaluator_.transform_to_ntt_inplace(cipher_vec[odd]);
+          }
+        }
+        evaluator_.add_inplace(cipher_vec[b], galois);
+        if (last_level && b < dims_[0]) {
+          evaluator_.transform_to_ntt_inplace(cipher_vec[b]);
+        }
+      }
+    });
   }
 
   return cipher_vec;
 }
 
+// Depth-first version of expand_query_inplace fused with the delayed modulus
+// first dimension. The top levels are expanded breadth-first until there is a
+// subtree per thread. Each subtree is walked depth-first and only holds its
+// path from the subtree root: one sibling ciphertext per level. The walks
+// advance in lockstep, one first dimension leaf per subtree at a time, and
+// each batch of leaves is added to a single set of column accumulators by
+// tasks that own disjoint columns. Only the accumulators of the query and one
+// leaf per subtree are held, against all dims_[0] leaves in the other modes.
+std::vector<seal::Ciphertext>
+PirServer::evaluate_first_dim_streaming(const DatabaseSnapshot &db, uint32_t client_id,
+                                        const seal::Ciphertext &query,
+                                        std::vector<seal::Ciphertext> &query_vector,
+                                        size_t &walk_bytes) {
+  const size_t tile = DatabaseConstants::TileCoeffs;
+  const seal::EncryptionParameters &params = context_.key_context_data()->parms();
+  size_t poly_degree = params.poly_modulus_degree();
+  auto expansion_key_ptr = expansion_keys(client_id);
+  const ExpansionKeys &keys = *expansion_key_ptr;
+  size_t num_rows = dims_[0];
+  size_t size_of_other_dims = DBSize_ / num_rows;
+  auto seal_params = context_.get_context_data(query.parms_id())->parms();
+  auto coeff_modulus = seal_params.coeff_modulus();
+  size_t coeff_count = seal_params.poly_modulus_degree();
+  size_t coeff_mod_count = coeff_modulus.size();
+  size_t encrypted_ntt_size = query.size();
+  size_t poly_size = coeff_count * coeff_mod_count;
+  size_t acc_size = encrypted_ntt_size * poly_size;
+  auto multiply_poly_acum = utils::multiply_poly_acum_kernel(utils::max_bit_count(coeff_modulus));
+  auto reducers = utils::make_reducers(coeff_modulus);
+
+  size_t exp = dims_[0] + pir_params_.get_l() * (dims_.size() - 1);
+  size_t expansion_factor = 0;
+  while ((size_t(1) << expansion_factor) < exp) {
+    expansion_factor++;
+  }
+  query_vector.assign(exp, seal::Ciphertext());
+
+  // Level split of the tree holds the roots of the subtrees.
+  size_t split = 0;
+  while (split < expansion_factor && (size_t(1) << split) < pool_->size()) {
+    split++;
+  }
+  size_t num_roots = std::min(size_t(1) << split, exp);
+  std::vector<seal::Ciphertext> roots(num_roots);
+  roots[0] = query;
+  for (size_t a = 0; a < split; a++) {
+    size_t expansion_const = size_t(1) << a;
+    uint32_t galois_elt = poly_degree / expansion_const + 1;
+    pool_->parallel_for(0, expansion_const, [&](size_t b) {
+      seal::Ciphertext galois;
+      std::vector<uint64_t> scratch;
+      keys.apply_galois(roots[b], galois_elt, galois);
+      if (b + expansion_const < num_roots) {
+        evaluator_.sub(roots[b], galois, roots[b + expansion_const]);
+        shift_inplace(roots[b + expansion_const], -expansion_const, scratch);
+      }
+      evaluator_.add_inplace(roots[b], galois);
+    });
+  }
+
+  // The walk of a subtree. A pending node is expanded when it is popped; its
+  // even child is computed in place and pushed last, so it is walked before
+  // the odd one, which is held in siblings[level of the parent] until then.
+  struct PendingNode {
+    size_t level;
+    size_t index;
+    seal::Ciphertext *ct;
+  };
+  struct SubtreeWalk {
+    std::vector<PendingNode> pending;
+    std::vector<seal::Ciphertext> siblings;
+    seal::Ciphertext galois;
+    std::vector<uint64_t> scratch;
+    // The first dimension leaf of the current batch, or nullptr.
+    const seal::Ciphertext *leaf = nullptr;
+    size_t row = 0;
+  };
+  std::vector<SubtreeWalk> walks(num_roots);
+  for (size_t root = 0; root < num_roots; root++) {
+    walks[root].siblings.resize(expansion_factor);
+    walks[root].pending.push_back({split, root, &roots[root]});
+  }
+
+  // Walks a subtree to its next first dimension leaf, storing the GSW leaves
+  // met on the way.
+  auto advance = [&](SubtreeWalk &walk) {
+    walk.leaf = nullptr;
+    while (!walk.pending.empty()) {
+      PendingNode node = walk.pending.back();
+      walk.pending.pop_back();
+      if (node.level == expansion_factor) {
+        if (node.index < num_rows) {
+          evaluator_.transform_to_ntt_inplace(*node.ct);
+          walk.leaf = node.ct;
+          walk.row = node.index;
+          return;
+        }
+        query_vector[node.index] = *node.ct;
+        continue;
+      }
+      size_t expansion_const = size_t(1) << node.level;
+      size_t odd = node.index + expansion_const;
+      keys.apply_galois(*node.ct, poly_degree / expansion_const + 1, walk.galois);
+      if (odd < exp) {
+        seal::Ciphertext &sibling = walk.siblings[node.level];
+        evaluator_.sub(*node.ct, walk.galois, sibling);
+        shift_inplace(sibling, -expansion_const, walk.scratch);
+        walk.pending.push_back({node.level + 1, odd, &sibling});
+      }
+      evaluator_.add_inplace(*node.ct, walk.galois);
+      walk.pending.push_back({node.level + 1, node.index, node.ct});
+    }
+  };
+
+  // The accumulators outlive the tasks that fill them, so they live in the
+  // caller's workspace.
+  QueryWorkspace &workspace = QueryWorkspace::local();
+  QueryWorkspace::Scope scope(workspace);
+  uint128_t *buffers = workspace.allocate<uint128_t>(size_of_other_dims * acc_size);
+  pool_->parallel_for(0, size_of_other_dims, [&](size_t col_id) {
+    std::fill_n(buffers + col_id * acc_size, acc_size, 0);
+  });
+
+  // Adds row i of column col_id, weighted by the leaf, to its accumulator.
+  auto accumulate = [&](size_t col_id, size_t i, const seal::Ciphertext &leaf,
+                        uint64_t *pt_scratch) {
+    uint128_t *col_ptr = buffers + col_id * acc_size;
+    if (db.layout == DatabaseLayout::Tiled) {
+      for (size_t offset = 0; offset < poly_size; offset += tile) {
+        const uint64_t *pt_ptr =
+            db.tiles_ptr + ((offset / tile) * DBSize_ + col_id * num_rows + i) * tile;
+        for (size_t poly_id = 0; poly_id < encrypted_ntt_size; poly_id++) {
+          multiply_poly_acum(leaf.data(poly_id) + offset, pt_ptr, tile,
+                             col_ptr + poly_id * poly_size + offset);
+        }
+      }
+      return;
+    }
+    const uint64_t *pt_ptr = ntt_plaintext(db, col_id + i * size_of_other_dims, pt_scratch);
+    if (pt_ptr == nullptr) {
+      return;
+    }
+    for (size_t poly_id = 0; poly_id < encrypted_ntt_size; poly_id++) {
+      multiply_poly_acum(leaf.data(poly_id), pt_ptr, poly_size, col_ptr + poly_id * poly_size);
+    }
+  };
+
+  while (true) {
+    pool_->parallel_for(0, num_roots, [&](size_t root) { advance(walks[root]); });
+    bool any_leaf = std::any_of(walks.begin(), walks.end(),
+                                [](const SubtreeWalk &walk) { return walk.leaf != nullptr; });
+    if (!any_leaf) {
+      break;
+    }
+    pool_->parallel_for(0, size_of_other_dims, [&](size_t col_id) {
+      QueryWorkspace &task_workspace = QueryWorkspace::local();
+      QueryWorkspace::Scope task_scope(task_workspace);
+      uint64_t *pt_scratch = task_workspace.allocate<uint64_t>(poly_size);
+      for (const SubtreeWalk &walk : walks) {
+        if (walk.leaf) {
+          accumulate(col_id, walk.row, *walk.leaf, pt_scratch);
+        }
+      }
+    });
+  }
+
+  std::vector<seal::Ciphertext> result(size_of_other_dims);
+  pool_->parallel_for(0, size_of_other_dims, [&](size_t col_id) {
+    seal::Ciphertext &ct = result[col_id];
+    ct.resize(context_, query.parms_id(), encrypted_ntt_size);
+    ct.is_ntt_form() = true;
+    const uint128_t *sum = buffers + col_id * acc_size;
+    for (size_t poly_id = 0; poly_id < encrypted_ntt_size; poly_id++) {
+      auto ct_ptr = ct.data(poly_id);
+      auto pt_ptr = sum + poly_id * poly_size;
+      for (size_t mod_id = 0; mod_id < coeff_mod_count; mod_id++) {
+        auto mod_idx = mod_id * coeff_count;
+        reducers[mod_id].reduce(pt_ptr + mod_idx, coeff_count, ct_ptr + mod_idx);
+      }
+    }
+    evaluator_.transform_from_ntt_inplace(ct);
+  });
+
+  // Ciphertexts keep their allocation, so the walks now hold as much as they
+  // ever did.
+  walk_bytes = ciphertext_bytes(roots);
+  for (const SubtreeWalk &walk : walks) {
+    walk_bytes += ciphertext_bytes(walk.siblings) + ciphertext_bytes(walk.galois);
+  }
+  return result;
+}
+
 void PirServer::set_client_galois_key(uint32_t client_id, seal::GaloisKeys client_key) {
-  client_galois_keys_[client_id] = client_key;
+  key_store_->set_expansion_keys(
+      client_id,
+      ExpansionKeys(pir_params_.get_data_gsw().context, client_key, expansion_galois_elts()));
+}
+
+void PirServer::set_client_gsw_key(uint32_t client_id, GSWMatrix &&gsw_key) {
+  key_store_->set_gsw_key(client_id, std::move(gsw_key));
+}
+
+void PirServer::set_key_store(std::shared_ptr<KeyStore> key_store) {
+  if (!key_store) {
+    throw std::invalid_argument("Key store must not be null");
+  }
+  key_store_ = std::move(key_store);
+}
+
+std::shared_ptr<KeyStore> PirServer::get_key_store() const { return key_store_; }
+
+std::shared_ptr<const ExpansionKeys> PirServer::expansion_keys(uint32_t client_id) const {
+  auto keys = key_store_->expansion_keys(client_id);
+  if (!keys) {
+    throw std::invalid_argument("No Galois keys for client " + std::to_string(client_id));
+  }
+  return keys;
 }
 
-void PirServer::set_client_gsw_key(uint32_t client_id, GSWCiphertext &&gsw_key) {
-  client_gsw_keys_[client_id] = gsw_key;
+std::shared_ptr<const GSWMatrix> PirServer::gsw_key(uint32_t client_id) const {
+  auto key = key_store_->gsw_key(client_id);
+  if (!key) {
+    throw std::invalid_argument("No GSW key for client " + std::to_string(client_id));
+  }
+  return key;
+}
+
+std::vector<uint32_t> PirServer::expansion_galois_elts() const {
+  size_t poly_degree = pir_params_.get_seal_params().poly_modulus_degree();
+  size_t exp = dims_[0] + pir_params_.get_l() * (dims_.size() - 1);
+  std::vector<uint32_t> galois_elts;
+  for (size_t expansion_const = 1; expansion_const < exp; expansion_const <<= 1) {
+    galois_elts.push_back(poly_degree / expansion_const + 1);
+  }
+  return galois_elts;
 }
 
 std::vector<seal::Ciphertext> PirServer::make_query(uint32_t client_id, PirQuery &&query) {
+  auto db = pin_database();
+  QueryWorkspace &workspace = QueryWorkspace::local();
+  workspace.reserve(workspace_bytes_);
+  std::vector<GSWMatrix> &selectors = workspace.selectors;
 
+  std::vector<seal::Ciphertext> query_vector, result;
+  size_t walk_bytes = 0;
   auto start_time = std::chrono::high_resolution_clock::now();
-  std::vector<seal::Ciphertext> query_vector = expand_query(client_id, query);
+  auto end_time = start_time;
+  if (expansion_mode_ == ExpansionMode::Streaming) {
+    result = evaluate_first_dim_streaming(*db, client_id, query, query_vector, walk_bytes);
+  } else {
+    query_vector = expand_query(client_id, query);
+
+    end_time = std::chrono::high_resolution_clock::now();
+    auto elapsed_time =
+        std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+    std::cout << "Query expansion time: " << elapsed_time.count() << " ms" << std::endl;
+
+    // The selectors only need the GSW leaves of the expansion, so they are
+    // built on the pool while this thread evaluates the first dimension.
+    auto selectors_built =
+        pool_->submit([&]() { build_selectors(client_id, query_vector, selectors); });
+    try {
+      result = evaluate_first_dim_delayed_mod(*db, query_vector);
+    } catch (...) {
+      selectors_built.wait();
+      throw;
+    }
+    selectors_built.get();
+  }
+
+  if (decryptor_) {
+    std::cout << "NOISE: " << decryptor_->invariant_noise_budget(result[0]) << std::endl;
+  }
+
+  auto end_time0 = std::chrono::high_resolution_clock::now();
+  auto elapsed_time0 = std::chrono::duration_cast<std::chrono::milliseconds>(end_time0 - end_time);
+  std::cout << (expansion_mode_ == ExpansionMode::Streaming ? "Query expansion and dim 0 time: "
+                                                             : "Dim 0 and GSW generation time: ")
+            << elapsed_time0.count() << " ms" << std::endl;
+  // The expanded ciphertexts are not taken from the workspace, so they are
+  // counted apart.
+  std::cout << "Expanded ciphertexts held: "
+            << (walk_bytes + ciphertext_bytes(query_vector)) / 1024 << " KB" << std::endl;
+
+  if (expansion_mode_ == ExpansionMode::Streaming) {
+    // The GSW leaves only exist once the streaming expansion is done.
+    build_selectors(client_id, query_vector, selectors);
+  }
+  result = evaluate_other_dims(selectors, std::move(result));
+
+  evaluator_.mod_switch_to_next_inplace(result[0]);
+  return result;
+}
+
+std::vector<std::vector<seal::Ciphertext>>
+PirServer::make_queries(std::vector<std::pair<uint32_t, PirQuery>> queries) {
+  auto db = pin_database();
+  QueryWorkspace::local().reserve(workspace_bytes_);
+  auto start_time = std::chrono::high_resolution_clock::now();
+  std::vector<std::vector<seal::Ciphertext>> query_vectors;
+  query_vectors.reserve(queries.size());
+  for (auto &[client_id, query] : queries) {
+    query_vectors.push_back(expand_query(client_id, query));
+  }
 
   auto end_time = std::chrono::high_resolution_clock::now();
   auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-  std::cout << "Query expansion time: " << elapsed_time.count() << " ms" << std::endl;
+  std::cout << "Batch query expansion time: " << elapsed_time.count() << " ms" << std::endl;
 
-  std::vector<seal::Ciphertext> result = evaluate_first_dim_delayed_mod(query_vector);
-
-  std::cout << "NOISE: " << decryptor_->invariant_noise_budget(result[0]) << std::endl;
+  // As in make_query, the selectors are built while the first dimension runs.
+  std::vector<std::vector<GSWMatrix>> selectors(queries.size());
+  auto selectors_built = pool_->submit([&]() {
+    for (size_t q = 0; q < queries.size(); q++) {
+      build_selectors(queries[q].first, query_vectors[q], selectors[q]);
+    }
+  });
+  std::vector<std::vector<seal::Ciphertext>> results;
+  try {
+    results = evaluate_first_dim_batched(*db, query_vectors);
+  } catch (...) {
+    selectors_built.wait();
+    throw;
+  }
+  selectors_built.get();
 
   auto end_time0 = std::chrono::high_resolution_clock::now();
   auto elapsed_time0 = std::chrono::duration_cast<std::chrono::milliseconds>(end_time0 - end_time);
-  std::cout << "Dim 0 time: " << elapsed_time0.count() << " ms" << std::endl;
+  std::cout << "Batch dim 0 and GSW generation time (" << queries.size()
+            << " queries): " << elapsed_time0.count() << " ms" << std::endl;
 
-  int ptr = dims_[0];
+  for (size_t q = 0; q < queries.size(); q++) {
+    results[q] = evaluate_other_dims(selectors[q], std::move(results[q]));
+    evaluator_.mod_switch_to_next_inplace(results[q][0]);
+  }
+  return results;
+}
+
+void PirServer::build_selectors(uint32_t client_id,
+                                const std::vector<seal::Ciphertext> &query_vector,
+                                std::vector<GSWMatrix> &selectors) {
+  auto start_time = std::chrono::high_resolution_clock::now();
   auto l = pir_params_.get_l();
-  for (int i = 1; i < dims_.size(); i++) {
-    GSWCiphertext gsw;
+  selectors.resize(dims_.size() - 1);
+  auto key = gsw_key(client_id);
+  pir_params_.get_key_gsw().queries_to_gsw(query_vector.data() + dims_[0], l, selectors.size(),
+                                           *key, selectors.data(), pool_.get());
 
-    std::vector<seal::Ciphertext> lwe_vector;
-    for (int k = 0; k < l; k++) {
-      lwe_vector.push_back(query_vector[ptr]);
-      ptr += 1;
-    }
-    key_gsw.query_to_gsw(lwe_vector, client_gsw_keys_[client_id], gsw);
+  auto end_time = std::chrono::high_resolution_clock::now();
+  auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+  std::cout << "GSW generation time (" << selectors.size()
+            << " dims): " << elapsed_time.count() << " ms" << std::endl;
+}
 
+std::vector<seal::Ciphertext>
+PirServer::evaluate_other_dims(const std::vector<GSWMatrix> &selectors,
+                               std::vector<seal::Ciphertext> result) {
+  auto end_time0 = std::chrono::high_resolution_clock::now();
+  for (size_t i = 1; i < dims_.size(); i++) {
+    result = evaluate_gsw_product(result, selectors[i - 1]);
     auto end_time1 = std::chrono::high_resolution_clock::now();
     auto elapsed_time1 =
         std::chrono::duration_cast<std::chrono::milliseconds>(end_time1 - end_time0);
-    std::cout << "Dim " << i << " GSW generation time: " << elapsed_time1.count() << " ms"
-              << std::endl;
-
-    result = evaluate_gsw_product(result, gsw);
-    end_time1 = std::chrono::high_resolution_clock::now();
-    elapsed_time1 = std::chrono::duration_cast<std::chrono::milliseconds>(end_time1 - end_time0);
     std::cout << "Dim " << i << " external product time: " << elapsed_time1.count() << " ms"
               << std::endl;
     end_time0 = end_time1;
   }
-
-  evaluator_.mod_switch_to_next_inplace(result[0]);
   return result;
 }
 
 std::vector<seal::Ciphertext> PirServer::make_query_delayed_mod(uint32_t client_id,
                                                                 PirQuery query) {
+  auto db = pin_database();
   std::vector<seal::Ciphertext> first_dim_selection_vector = expand_query(client_id, query);
 
-  std::vector<seal::Ciphertext> result = evaluate_first_dim_delayed_mod(first_dim_selection_vector);
+  std::vector<seal::Ciphertext> result =
+      evaluate_first_dim_delayed_mod(*db, first_dim_selection_vector);
 
   return result;
 }
 
 std::vector<seal::Ciphertext> PirServer::make_query_regular_mod(uint32_t client_id,
                                                                 PirQuery query) {
+  auto db = pin_database();
   std::vector<seal::Ciphertext> first_dim_selection_vector = expand_query(client_id, query);
 
-  std::vector<seal::Ciphertext> result = evaluate_first_dim(first_dim_selection_vector);
+  std::vector<seal::Ciphertext> result = evaluate_first_dim(*db, first_dim_selection_vector);
 
   return result;
 }
 
-void PirServer::set_database(std::vector<Entry> &new_db) {
-  db_ = Database();
-
+uint64_t PirServer::set_database(std::vector<Entry> &new_db) {
   // Flattens data into vector of u8s and pads each entry with 0s to entry_size
   // number of bytes.
   for (Entry &entry : new_db) {
@@ -251,66 +962,618 @@ void PirServer::set_database(std::vector<Entry> &new_db) {
     }
   }
 
+  size_t entry_size = pir_params_.get_entry_size();
   size_t bits_per_coeff = pir_params_.get_num_bits_per_coeff();
   size_t num_coeffs = pir_params_.get_seal_params().poly_modulus_degree();
-  size_t num_bits_per_plaintext = num_coeffs * bits_per_coeff;
-  size_t num_entries_per_plaintext = pir_params_.get_num_entries_per_plaintext();
-  size_t num_plaintexts = new_db.size() / num_entries_per_plaintext;
-
-  db_ = Database();
+  size_t bytes_per_plaintext = pir_params_.get_num_bytes_per_plaintext();
+  // Plaintexts holding at least part of an entry.
+  size_t num_plaintexts =
+      new_db.empty() ? 0
+                     : (pir_params_.get_entry_byte_offset(new_db.size() - 1) + entry_size +
+                        bytes_per_plaintext - 1) /
+                           bytes_per_plaintext;
 
-  const uint128_t coeff_mask = (uint128_t(1) << (bits_per_coeff)) - 1;
+  std::lock_guard<std::mutex> lock(db_writer_mutex_);
+  auto next = next_snapshot(db_layout_);
+  next->changed_plaintexts.reset();
+  Database &db = next->plaintexts;
+  // Pad database with missing plaintexts until DBSize_
+  db.assign(std::max<size_t>(num_plaintexts, DBSize_), std::nullopt);
 
-  for (int i = 0; i < num_plaintexts; i++) {
-    uint128_t data_buffer = 0;
-    size_t data_offset = 0;
+  // Each plaintext holds its bytes of the database as one bit stream. Empty
+  // entries are zeros, and a plaintext of only empty entries is missing.
+  pool_->parallel_for(0, num_plaintexts, [&](size_t i) {
+    auto [begin, end] = pir_params_.get_plaintext_entries(i);
+    end = std::min(end, new_db.size());
+    if (std::all_of(new_db.begin() + begin, new_db.begin() + end,
+                    [](const Entry &entry) { return entry.empty(); })) {
+      return;
+    }
+    std::vector<uint8_t> bytes(bytes_per_plaintext, 0);
+    size_t plaintext_begin = i * bytes_per_plaintext;
+    for (size_t j = begin; j < end; j++) {
+      // The part of the entry inside this plaintext.
+      size_t offset = pir_params_.get_entry_byte_offset(j);
+      size_t lo = std::max(offset, plaintext_begin);
+      size_t hi = std::min(offset + new_db[j].size(), plaintext_begin + bytes_per_plaintext);
+      if (lo < hi) {
+        std::copy(new_db[j].begin() + (lo - offset), new_db[j].begin() + (hi - offset),
+                  bytes.begin() + (lo - plaintext_begin));
+      }
+    }
     seal::Plaintext plaintext(num_coeffs);
+    utils::bytes_to_coeffs(bytes.data(), bytes.size(), bits_per_coeff, plaintext.data());
+    db[i] = std::move(plaintext);
+  });
 
-    int sum_size = 0;
-    for (int j = num_entries_per_plaintext * i;
-         j < std::min(num_entries_per_plaintext * (i + 1), new_db.size()); j++) {
-      sum_size += new_db[j].size();
+  // Process database
+  preprocess_ntt(*next);
+  return publish(std::move(next));
+}
+
+uint64_t PirServer::set_database_from_reader(const EntryReader &reader) {
+  size_t entry_size = pir_params_.get_entry_size();
+  size_t bits_per_coeff = pir_params_.get_num_bits_per_coeff();
+  size_t num_coeffs = pir_params_.get_seal_params().poly_modulus_degree();
+  size_t bytes_per_plaintext = pir_params_.get_num_bytes_per_plaintext();
+  bool dense = pir_params_.get_entry_packing() == EntryPacking::Dense;
+  // A chunk holds more than one entry, so that at most one entry is split
+  // between two chunks.
+  size_t chunk_plaintexts = std::max<size_t>(DatabaseConstants::IngestChunkPlaintexts * pool_->size(),
+                                             entry_size / bytes_per_plaintext + 1);
+  size_t chunk_bytes = chunk_plaintexts * bytes_per_plaintext;
+
+  bool ended = false;
+  // Dense packing: the end of an entry split between two chunks.
+  std::vector<uint8_t> carry;
+
+  // Reads up to count entries into buffer and returns how many were read.
+  auto read_entries = [&](uint8_t *buffer, size_t count) {
+    size_t num_read = 0;
+    while (!ended && num_read < count) {
+      size_t num = reader(buffer + num_read * entry_size, count - num_read);
+      if (num > count - num_read) {
+        throw std::runtime_error("EntryReader returned more entries than requested");
+      }
+      ended = num == 0;
+      num_read += num;
+    }
+    return num_read;
+  };
+
+  // Fills a chunk with the bytes of the next plaintexts and returns the
+  // number of plaintexts holding data.
+  auto read_chunk = [&](std::vector<uint8_t> &chunk) -> size_t {
+    std::fill(chunk.begin(), chunk.end(), 0);
+    if (!dense) {
+      size_t num_entries_per_plaintext = pir_params_.get_num_entries_per_plaintext();
+      size_t num_plaintexts = 0;
+      while (num_plaintexts < chunk_plaintexts &&
+             read_entries(chunk.data() + num_plaintexts * bytes_per_plaintext,
+                          num_entries_per_plaintext) > 0) {
+        num_plaintexts++;
+      }
+      return num_plaintexts;
+    }
+
+    size_t pos = carry.size();
+    std::copy(carry.begin(), carry.end(), chunk.begin());
+    carry.clear();
+    pos += read_entries(chunk.data() + pos, (chunk_bytes - pos) / entry_size) * entry_size;
+    if (pos < chunk_bytes) {
+      std::vector<uint8_t> entry(entry_size);
+      if (read_entries(entry.data(), 1) == 1) {
+        size_t head = chunk_bytes - pos;
+        std::copy_n(entry.begin(), head, chunk.begin() + pos);
+        carry.assign(entry.begin() + head, entry.end());
+        pos = chunk_bytes;
+      }
+    }
+    return (pos + bytes_per_plaintext - 1) / bytes_per_plaintext;
+  };
+
+  std::lock_guard<std::mutex> lock(db_writer_mutex_);
+  auto next = next_snapshot(db_layout_);
+  allocate_database(*next);
+
+  std::vector<uint8_t> chunk(chunk_bytes), next_chunk(chunk_bytes);
+  size_t num_plaintexts = read_chunk(chunk);
+  for (size_t first = 0; num_plaintexts > 0 && first < DBSize_; first += chunk_plaintexts) {
+    // The next chunk is read while this one is packed and transformed.
+    std::future<size_t> next_read;
+    if (num_plaintexts == chunk_plaintexts && first + chunk_plaintexts < DBSize_) {
+      next_read = std::async(std::launch::async, read_chunk, std::ref(next_chunk));
     }
+    pool_->parallel_for(0, std::min<size_t>(num_plaintexts, DBSize_ - first), [&](size_t i) {
+      std::vector<uint64_t> coeffs(num_coeffs, 0);
+      utils::bytes_to_coeffs(chunk.data() + i * bytes_per_plaintext, bytes_per_plaintext,
+                             bits_per_coeff, coeffs.data());
+      store_plaintext(*next, first + i, coeffs);
+    });
+    num_plaintexts = next_read.valid() ? next_read.get() : 0;
+    chunk.swap(next_chunk);
+  }
+  return publish(std::move(next));
+}
+
+uint64_t PirServer::set_database_from_file(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("Cannot open " + path);
+  }
+  size_t entry_size = pir_params_.get_entry_size();
+  return set_database_from_reader([&](uint8_t *buffer, size_t max_entries) -> size_t {
+    in.read(reinterpret_cast<char *>(buffer), max_entries * entry_size);
+    size_t num_bytes = in.gcount();
+    size_t num_entries = (num_bytes + entry_size - 1) / entry_size;
+    std::fill(buffer + num_bytes, buffer + num_entries * entry_size, 0);
+    return num_entries;
+  });
+}
+
+// The builds run on their own thread rather than on the pool: they hold
+// db_writer_mutex_ for their whole duration and would otherwise keep a worker
+// from helping the queries.
+std::future<uint64_t> PirServer::set_database_async(std::vector<Entry> new_db) {
+  return std::async(std::launch::async, [this, new_db = std::move(new_db)]() mutable {
+    return set_database(new_db);
+  });
+}
+
+std::future<uint64_t>
+PirServer::update_entries_async(std::vector<std::pair<size_t, Entry>> updates) {
+  return std::async(std::launch::async, [this, updates = std::move(updates)]() {
+    return update_entries(updates);
+  });
+}
+
+uint64_t PirServer::get_database_version() const {
+  std::shared_ptr<const DatabaseSnapshot> db = std::atomic_load(&db_);
+  return db ? db->version : 0;
+}
+
+std::shared_ptr<const DatabaseSnapshot> PirServer::pin_database() const {
+  std::shared_ptr<const DatabaseSnapshot> db = std::atomic_load(&db_);
+  if (!db) {
+    throw std::logic_error("The server has no database");
+  }
+  return db;
+}
+
+std::shared_ptr<DatabaseSnapshot> PirServer::next_snapshot(DatabaseLayout layout) {
+  // The retired version is no longer db_, so no new query can pin it; once
+  // this is the only reference left it is safe to overwrite.
+  if (db_retired_ && db_retired_.use_count() == 1 && db_retired_->layout == layout &&
+      !db_retired_->mapping) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return std::move(db_retired_);
+  }
+  db_retired_.reset();
+  auto next = std::make_shared<DatabaseSnapshot>();
+  next->layout = layout;
+  return next;
+}
+
+uint64_t PirServer::publish(std::shared_ptr<DatabaseSnapshot> next) {
+  uint64_t version = ++db_version_;
+  next->version = version;
+  db_retired_ = std::atomic_exchange(&db_, std::move(next));
+  return version;
+}
 
-    if (sum_size == 0) {
-      db_.push_back({});
-      continue;
+void PirServer::preprocess_ntt(DatabaseSnapshot &db) {
+  if (db.layout == DatabaseLayout::Compact) {
+    build_compact(db);
+    return;
+  }
+  pool_->parallel_for(0, db.plaintexts.size(), [&](size_t i) {
+    if (db.plaintexts[i].has_value()) {
+      evaluator_.transform_to_ntt_inplace(*db.plaintexts[i], context_.first_parms_id());
     }
+  });
+  if (db.layout == DatabaseLayout::Tiled) {
+    build_tiles(db);
+  }
+}
 
-    int index = 0;
-    for (int j = num_entries_per_plaintext * i;
-         j < std::min(num_entries_per_plaintext * (i + 1), new_db.size()); j++) {
-      for (int k = 0; k < pir_params_.get_entry_size(); k++) {
-        data_buffer += uint128_t(new_db[j][k]) << data_offset;
-        data_offset += 8;
-        while (data_offset >= bits_per_coeff) {
-          plaintext[index] = data_buffer & coeff_mask;
-          index++;
-          data_buffer >>= bits_per_coeff;
-          data_offset -= bits_per_coeff;
+void PirServer::allocate_database(DatabaseSnapshot &db) {
+  db.changed_plaintexts.reset();
+  db.mapping.reset();
+  db.tiles_ptr = nullptr;
+  if (db.layout == DatabaseLayout::Plaintexts) {
+    db.plaintexts.assign(DBSize_, std::nullopt);
+    return;
+  }
+  db.plaintexts = Database();
+  if (db.layout == DatabaseLayout::Tiled) {
+    auto &parms = context_.first_context_data()->parms();
+    db.tiles.assign(DBSize_ * parms.poly_modulus_degree() * parms.coeff_modulus().size(), 0);
+    db.tiles_ptr = db.tiles.data();
+  } else {
+    db.compact.assign(DBSize_ * compact_words_per_plaintext(), 0);
+    db.compact_present.assign(DBSize_, 0);
+  }
+}
+
+// Moves the NTT plaintexts of db.plaintexts into db.tiles. Plaintexts stored
+// at index col + row * size_of_other_dims end up at
+// ((block * size_of_other_dims + col) * dims_[0] + row) * TileCoeffs.
+// Missing plaintexts are stored as zeros.
+void PirServer::build_tiles(DatabaseSnapshot &db) {
+  const size_t tile = DatabaseConstants::TileCoeffs;
+  size_t num_rows = dims_[0];
+  size_t size_of_other_dims = DBSize_ / num_rows;
+  auto &parms = context_.first_context_data()->parms();
+  size_t poly_size = parms.poly_modulus_degree() * parms.coeff_modulus().size();
+  size_t num_blocks = poly_size / tile;
+
+  db.mapping.reset();
+  db.tiles.assign(DBSize_ * poly_size, 0);
+  db.tiles_ptr = db.tiles.data();
+  pool_->parallel_for(0, num_blocks, [&](size_t block_id) {
+    uint64_t *block_ptr = db.tiles.data() + block_id * DBSize_ * tile;
+    for (size_t col_id = 0; col_id < size_of_other_dims; col_id++) {
+      for (size_t i = 0; i < num_rows; i++) {
+        auto &plaintext = db.plaintexts[col_id + i * size_of_other_dims];
+        if (plaintext.has_value()) {
+          std::copy_n(plaintext->data() + block_id * tile, tile,
+                      block_ptr + (col_id * num_rows + i) * tile);
         }
       }
     }
-    if (data_offset > 0) {
-      plaintext[index] = data_buffer & coeff_mask;
-      index++;
+  });
+  db.plaintexts = Database();
+}
+
+size_t PirServer::compact_words_per_plaintext() const {
+  size_t coeff_count = pir_params_.get_seal_params().poly_modulus_degree();
+  return (coeff_count * pir_params_.get_num_bits_per_coeff() + 63) / 64;
+}
+
+// Packs the coefficient form plaintexts of db.plaintexts into db.compact.
+void PirServer::build_compact(DatabaseSnapshot &db) {
+  size_t coeff_count = pir_params_.get_seal_params().poly_modulus_degree();
+  size_t bits_per_coeff = pir_params_.get_num_bits_per_coeff();
+  size_t words = compact_words_per_plaintext();
+
+  db.compact.assign(DBSize_ * words, 0);
+  db.compact_present.assign(DBSize_, 0);
+  pool_->parallel_for(0, DBSize_, [&](size_t i) {
+    if (db.plaintexts[i].has_value()) {
+      utils::pack_coeffs(db.plaintexts[i]->data(), coeff_count, bits_per_coeff,
+                         db.compact.data() + i * words);
+      db.compact_present[i] = 1;
     }
-    db_.push_back(plaintext);
+  });
+  db.plaintexts = Database();
+}
+
+const uint64_t *PirServer::ntt_plaintext(const DatabaseSnapshot &db, size_t index,
+                                         uint64_t *scratch) const {
+  if (db.layout == DatabaseLayout::Plaintexts) {
+    return db.plaintexts[index].has_value() ? db.plaintexts[index]->data() : nullptr;
+  }
+  if (db.layout != DatabaseLayout::Compact) {
+    throw std::logic_error("ntt_plaintext is not available with the tiled layout");
   }
+  if (!db.compact_present[index]) {
+    return nullptr;
+  }
+
+  // Same result as Evaluator::transform_to_ntt_inplace on the plaintext: the
+  // coefficients are smaller than every coefficient modulus, so each RNS limb
+  // is a copy of them.
+  auto context_data = context_.first_context_data();
+  auto &coeff_modulus = context_data->parms().coeff_modulus();
+  size_t coeff_count = context_data->parms().poly_modulus_degree();
+  size_t coeff_mod_count = coeff_modulus.size();
+  auto ntt_tables = context_data->small_ntt_tables();
 
-  // Pad database with plaintext of 1s until DBSize_
-  for (size_t i = db_.size(); i < DBSize_; i++) {
-    db_.push_back({});
+  utils::unpack_coeffs(db.compact.data() + index * compact_words_per_plaintext(), coeff_count,
+                       pir_params_.get_num_bits_per_coeff(), scratch);
+  for (size_t mod_id = 1; mod_id < coeff_mod_count; mod_id++) {
+    std::copy_n(scratch, coeff_count, scratch + mod_id * coeff_count);
+  }
+  for (size_t mod_id = 0; mod_id < coeff_mod_count; mod_id++) {
+    seal::util::ntt_negacyclic_harvey(seal::util::CoeffIter(scratch + mod_id * coeff_count),
+                                      ntt_tables[mod_id]);
   }
+  return scratch;
+}
 
-  // Process database
-  preprocess_ntt();
+std::vector<uint64_t> PirServer::plaintext_coeffs(const DatabaseSnapshot &db, size_t index) const {
+  auto context_data = context_.first_context_data();
+  size_t coeff_count = context_data->parms().poly_modulus_degree();
+  std::vector<uint64_t> coeffs(coeff_count, 0);
+
+  if (db.layout == DatabaseLayout::Compact) {
+    if (db.compact_present[index]) {
+      utils::unpack_coeffs(db.compact.data() + index * compact_words_per_plaintext(),
+                           coeff_count, pir_params_.get_num_bits_per_coeff(), coeffs.data());
+    }
+    return coeffs;
+  }
+
+  // The coefficients are smaller than the first coefficient modulus, so the
+  // inverse NTT of the first RNS limb recovers them exactly.
+  if (db.layout == DatabaseLayout::Plaintexts) {
+    if (!db.plaintexts[index].has_value()) {
+      return coeffs;
+    }
+    std::copy_n(db.plaintexts[index]->data(), coeff_count, coeffs.data());
+  } else {
+    const size_t tile = DatabaseConstants::TileCoeffs;
+    size_t num_rows = dims_[0];
+    size_t size_of_other_dims = DBSize_ / num_rows;
+    size_t col_id = index % size_of_other_dims, row = index / size_of_other_dims;
+    for (size_t block_id = 0; block_id < coeff_count / tile; block_id++) {
+      std::copy_n(db.tiles_ptr + (block_id * DBSize_ + col_id * num_rows + row) * tile, tile,
+                  coeffs.data() + block_id * tile);
+    }
+  }
+  seal::util::inverse_ntt_negacyclic_harvey(seal::util::CoeffIter(coeffs.data()),
+                                            context_data->small_ntt_tables()[0]);
+  return coeffs;
+}
+
+void PirServer::store_plaintext(DatabaseSnapshot &db, size_t index,
+                                const std::vector<uint64_t> &coeffs) {
+  if (db.layout == DatabaseLayout::Compact) {
+    uint64_t *packed = db.compact.data() + index * compact_words_per_plaintext();
+    std::fill_n(packed, compact_words_per_plaintext(), 0);
+    utils::pack_coeffs(coeffs.data(), coeffs.size(), pir_params_.get_num_bits_per_coeff(),
+                       packed);
+    db.compact_present[index] = 1;
+    return;
+  }
+
+  seal::Plaintext plaintext(coeffs.size());
+  std::copy(coeffs.begin(), coeffs.end(), plaintext.data());
+  evaluator_.transform_to_ntt_inplace(plaintext, context_.first_parms_id());
+  if (db.layout == DatabaseLayout::Plaintexts) {
+    db.plaintexts[index] = std::move(plaintext);
+    return;
+  }
+
+  const size_t tile = DatabaseConstants::TileCoeffs;
+  size_t num_rows = dims_[0];
+  size_t size_of_other_dims = DBSize_ / num_rows;
+  size_t col_id = index % size_of_other_dims, row = index / size_of_other_dims;
+  size_t poly_size = plaintext.coeff_count();
+  for (size_t block_id = 0; block_id < poly_size / tile; block_id++) {
+    std::copy_n(plaintext.data() + block_id * tile, tile,
+                db.tiles.data() + (block_id * DBSize_ + col_id * num_rows + row) * tile);
+  }
+}
+
+void PirServer::copy_database(const DatabaseSnapshot &from, DatabaseSnapshot &to) {
+  to.layout = from.layout;
+  to.plaintexts = from.plaintexts;
+  to.compact = from.compact;
+  to.compact_present = from.compact_present;
+  to.mapping.reset();
+  if (from.tiles_ptr == nullptr) {
+    utils::AlignedVector<uint64_t>().swap(to.tiles);
+    to.tiles_ptr = nullptr;
+    return;
+  }
+
+  const size_t tile = DatabaseConstants::TileCoeffs;
+  auto &parms = context_.first_context_data()->parms();
+  size_t num_blocks = parms.poly_modulus_degree() * parms.coeff_modulus().size() / tile;
+  size_t block_size = DBSize_ * tile;
+  to.tiles.resize(num_blocks * block_size);
+  to.tiles_ptr = to.tiles.data();
+  pool_->parallel_for(0, num_blocks, [&](size_t block_id) {
+    std::copy_n(from.tiles_ptr + block_id * block_size, block_size,
+                to.tiles.data() + block_id * block_size);
+  });
 }
 
-void PirServer::preprocess_ntt() {
-  for (auto &plaintext : db_) {
-    if (plaintext.has_value()) {
-      evaluator_.transform_to_ntt_inplace(*plaintext, context_.first_parms_id());
+void PirServer::copy_plaintext(const DatabaseSnapshot &from, DatabaseSnapshot &to, size_t index) {
+  if (from.layout == DatabaseLayout::Plaintexts) {
+    to.plaintexts[index] = from.plaintexts[index];
+    return;
+  }
+  if (from.layout == DatabaseLayout::Compact) {
+    size_t words = compact_words_per_plaintext();
+    std::copy_n(from.compact.data() + index * words, words, to.compact.data() + index * words);
+    to.compact_present[index] = from.compact_present[index];
+    return;
+  }
+
+  const size_t tile = DatabaseConstants::TileCoeffs;
+  size_t num_rows = dims_[0];
+  size_t size_of_other_dims = DBSize_ / num_rows;
+  size_t col_id = index % size_of_other_dims, row = index / size_of_other_dims;
+  auto &parms = context_.first_context_data()->parms();
+  size_t poly_size = parms.poly_modulus_degree() * parms.coeff_modulus().size();
+  for (size_t block_id = 0; block_id < poly_size / tile; block_id++) {
+    size_t offset = (block_id * DBSize_ + col_id * num_rows + row) * tile;
+    std::copy_n(from.tiles_ptr + offset, tile, to.tiles.data() + offset);
+  }
+}
+
+uint64_t PirServer::update_entries(const std::vector<std::pair<size_t, Entry>> &updates) {
+  size_t entry_size = pir_params_.get_entry_size();
+  size_t bytes_per_plaintext = pir_params_.get_num_bytes_per_plaintext();
+  size_t bits_per_coeff = pir_params_.get_num_bits_per_coeff();
+
+  // Groups the updates by the plaintexts they touch. A later update of an
+  // entry wins.
+  std::map<size_t, std::vector<const std::pair<size_t, Entry> *>> plaintext_updates;
+  for (auto &update : updates) {
+    if (update.first >= pir_params_.get_num_entries()) {
+      throw std::invalid_argument("Entry index is out of range");
+    }
+    if (update.second.size() > entry_size) {
+      throw std::invalid_argument("Entry size is too large");
+    }
+    auto [first, count] = pir_params_.get_entry_plaintexts(update.first);
+    for (size_t i = first; i < first + count; i++) {
+      plaintext_updates[i].push_back(&update);
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(db_writer_mutex_);
+  std::shared_ptr<const DatabaseSnapshot> current = pin_database();
+  auto next = next_snapshot(current->layout);
+
+  // A reused snapshot holds the version before current, which differs from
+  // current only in the plaintexts current changed.
+  if (next->version != 0 && next->version + 1 == current->version &&
+      current->changed_plaintexts.has_value()) {
+    auto &changed = *current->changed_plaintexts;
+    pool_->parallel_for(0, changed.size(),
+                        [&](size_t i) { copy_plaintext(*current, *next, changed[i]); });
+  } else {
+    copy_database(*current, *next);
+  }
+
+  std::vector<std::pair<size_t, std::vector<const std::pair<size_t, Entry> *>>> work(
+      plaintext_updates.begin(), plaintext_updates.end());
+  pool_->parallel_for(0, work.size(), [&](size_t task_id) {
+    auto &[index, entries] = work[task_id];
+    std::vector<uint64_t> coeffs = plaintext_coeffs(*next, index);
+    Entry padded(entry_size);
+    size_t plaintext_begin = index * bytes_per_plaintext;
+    for (auto update : entries) {
+      std::fill(padded.begin(), padded.end(), 0);
+      std::copy(update->second.begin(), update->second.end(), padded.begin());
+      // Writes the part of the entry inside this plaintext.
+      size_t offset = pir_params_.get_entry_byte_offset(update->first);
+      size_t lo = std::max(offset, plaintext_begin);
+      size_t hi = std::min(offset + entry_size, plaintext_begin + bytes_per_plaintext);
+      utils::write_entry_bits(padded.data() + (lo - offset), hi - lo, (lo - plaintext_begin) * 8,
+                              bits_per_coeff, coeffs.data());
     }
+    store_plaintext(*next, index, coeffs);
+  });
+
+  std::vector<size_t> changed;
+  changed.reserve(work.size());
+  for (auto &[index, entries] : work) {
+    changed.push_back(index);
   }
+  next->changed_plaintexts = std::move(changed);
+  return publish(std::move(next));
+}
+
+void PirServer::save_database(const std::string &path) {
+  auto db = pin_database();
+  if (db->layout == DatabaseLayout::Compact) {
+    throw std::logic_error("save_database is not available with the compact layout");
+  }
+  const size_t tile = DatabaseConstants::TileCoeffs;
+  size_t num_rows = dims_[0];
+  size_t size_of_other_dims = DBSize_ / num_rows;
+  auto &parms = context_.first_context_data()->parms();
+  size_t poly_size = parms.poly_modulus_degree() * parms.coeff_modulus().size();
+  size_t num_blocks = poly_size / tile;
+
+  DatabaseFileHeader header{};
+  std::memcpy(header.magic, DatabaseFileMagic, sizeof(header.magic));
+  header.version = DatabaseFileVersion;
+  header.header_size = sizeof(DatabaseFileHeader);
+  std::copy(context_.first_parms_id().begin(), context_.first_parms_id().end(), header.parms_id);
+  header.poly_modulus_degree = parms.poly_modulus_degree();
+  header.coeff_mod_count = parms.coeff_modulus().size();
+  header.plain_modulus = parms.plain_modulus().value();
+  header.db_size = DBSize_;
+  header.num_dims = dims_.size();
+  header.first_dim = dims_[0];
+  header.num_entries = pir_params_.get_num_entries();
+  header.entry_size = pir_params_.get_entry_size();
+  header.entry_packing = static_cast<uint64_t>(pir_params_.get_entry_packing());
+  header.tile_coeffs = tile;
+  header.tiles_offset = DatabaseFileAlignment;
+  header.tiles_size = DBSize_ * poly_size * sizeof(uint64_t);
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    throw std::runtime_error("Cannot open " + path + " for writing");
+  }
+  std::vector<char> padding(header.tiles_offset, 0);
+  out.write(padding.data(), padding.size());
+
+  // Writes one block of every plaintext at a time, gathering it from
+  // db->plaintexts when the database is not already tiled.
+  std::vector<uint64_t> block(DBSize_ * tile);
+  uint64_t checksum = utils::checksum64(nullptr, 0);
+  for (size_t block_id = 0; block_id < num_blocks; block_id++) {
+    const uint64_t *block_ptr = db->tiles_ptr + block_id * DBSize_ * tile;
+    if (db->layout != DatabaseLayout::Tiled) {
+      std::fill(block.begin(), block.end(), 0);
+      for (size_t col_id = 0; col_id < size_of_other_dims; col_id++) {
+        for (size_t i = 0; i < num_rows; i++) {
+          auto &plaintext = db->plaintexts[col_id + i * size_of_other_dims];
+          if (plaintext.has_value()) {
+            std::copy_n(plaintext->data() + block_id * tile, tile,
+                        block.data() + (col_id * num_rows + i) * tile);
+          }
+        }
+      }
+      block_ptr = block.data();
+    }
+    checksum = utils::checksum64(block_ptr, DBSize_ * tile, checksum);
+    out.write(reinterpret_cast<const char *>(block_ptr), DBSize_ * tile * sizeof(uint64_t));
+  }
+
+  header.checksum = checksum;
+  out.seekp(0);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  if (!out) {
+    throw std::runtime_error("Failed to write " + path);
+  }
+}
+
+uint64_t PirServer::load_database(const std::string &path, bool verify_checksum) {
+  auto mapping = std::make_shared<const utils::MappedFile>(path);
+  DatabaseFileHeader header;
+  if (mapping->size() < sizeof(header)) {
+    throw std::invalid_argument(path + " is not an OnionPIR database file");
+  }
+  std::memcpy(&header, mapping->data(), sizeof(header));
+  if (std::memcmp(header.magic, DatabaseFileMagic, sizeof(header.magic)) != 0) {
+    throw std::invalid_argument(path + " is not an OnionPIR database file");
+  }
+  if (header.version != DatabaseFileVersion || header.header_size != sizeof(header)) {
+    throw std::invalid_argument(path + " has an unsupported database file version");
+  }
+
+  auto &parms = context_.first_context_data()->parms();
+  size_t poly_size = parms.poly_modulus_degree() * parms.coeff_modulus().size();
+  auto &parms_id = context_.first_parms_id();
+  bool matches = std::equal(parms_id.begin(), parms_id.end(), header.parms_id) &&
+                 header.poly_modulus_degree == parms.poly_modulus_degree() &&
+                 header.coeff_mod_count == parms.coeff_modulus().size() &&
+                 header.plain_modulus == parms.plain_modulus().value() &&
+                 header.db_size == DBSize_ && header.num_dims == dims_.size() &&
+                 header.first_dim == dims_[0] &&
+                 header.num_entries == pir_params_.get_num_entries() &&
+                 header.entry_size == pir_params_.get_entry_size() &&
+                 header.entry_packing ==
+                     static_cast<uint64_t>(pir_params_.get_entry_packing()) &&
+                 header.tile_coeffs == DatabaseConstants::TileCoeffs &&
+                 header.tiles_size == DBSize_ * poly_size * sizeof(uint64_t);
+  if (!matches) {
+    throw std::invalid_argument(path + " was written for different PIR parameters");
+  }
+  if (header.tiles_offset % alignof(uint64_t) != 0 ||
+      header.tiles_offset + header.tiles_size > mapping->size()) {
+    throw std::invalid_argument(path + " is truncated");
+  }
+
+  auto tiles = reinterpret_cast<const uint64_t *>(mapping->data() + header.tiles_offset);
+  if (verify_checksum &&
+      utils::checksum64(tiles, header.tiles_size / sizeof(uint64_t)) != header.checksum) {
+    throw std::invalid_argument(path + " failed the checksum");
+  }
+
+  auto next = std::make_shared<DatabaseSnapshot>();
+  next->layout = DatabaseLayout::Tiled;
+  next->mapping = mapping;
+  next->tiles_ptr = tiles;
+  std::lock_guard<std::mutex> lock(db_writer_mutex_);
+  return publish(std::move(next));
 }
\ No newline at end of file
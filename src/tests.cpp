@@ -1,11 +1,24 @@
 #include "tests.h"
+#include "executor.h"
+#include "expansion_keys.h"
 #include "external_prod.h"
+#include "kernels.h"
+#include "key_store.h"
 #include "pir.h"
+#include "reduction.h"
 #include "seal/util/scalingvariant.h"
+#include "serialization.h"
 #include "server.h"
 #include "utils.h"
+#include "workspace.h"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <random>
+#include <thread>
+#include <unistd.h>
 
 void run_tests() {
   PirParams pir_params(256, 2, 20000, 5, 15, 15);
@@ -15,7 +28,27 @@ void run_tests() {
 
   // bfv_example();
   // test_external_product();
+  // test_decomp_rlwe();
+  // test_external_product_batch();
+  // test_query_workspace();
+  // test_reduction();
+  // test_kernels();
+  // test_expansion_keys();
   // test_pir();
+  // test_batch_pir();
+  // test_concurrent_queries();
+  // test_multiple_params();
+  // test_key_store();
+  // test_key_store_concurrent_load();
+  // test_serialization();
+  // test_database_file();
+  // test_database_layouts();
+  // test_update_entries();
+  // test_database_snapshots();
+  // test_database_streaming();
+  // test_dense_packing();
+  // test_expansion_modes();
+  // test_multiply_poly_acum();
   test_keyword_pir();
 }
 
@@ -48,6 +81,7 @@ void bfv_example() {
 
 void test_external_product() {
   PirParams pir_params(256, 2, 20000, 5, 15, 15);
+  const GSWEval &data_gsw = pir_params.get_data_gsw();
   pir_params.print_values();
   auto parms = pir_params.get_seal_params();
   auto context_ = seal::SEALContext(parms);
@@ -73,7 +107,7 @@ void test_external_product() {
 
   std::cout << "Noise budget before: " << decryptor_.invariant_noise_budget(a_encrypted)
             << std::endl;
-  GSWCiphertext b_gsw;
+  GSWMatrix b_gsw;
   data_gsw.encrypt_plain_to_gsw(b, encryptor_, decryptor_, b_gsw);
 
   debug(a_encrypted.data(0), "AENC[0]", coeff_count);
@@ -91,6 +125,266 @@ void test_external_product() {
   std::cout << result.nonzero_coeff_count() << std::endl;
 }
 
+// Checks that the batched external product, spread over a thread pool, gives
+// the same ciphertexts as one external product per ciphertext.
+void test_external_product_batch() {
+  PirParams pir_params(256, 2, 20000, 5, 15, 15);
+  const GSWEval &data_gsw = pir_params.get_data_gsw();
+  auto parms = pir_params.get_seal_params();
+  auto context_ = seal::SEALContext(parms);
+  auto keygen_ = seal::KeyGenerator(context_);
+  auto secret_key_ = keygen_.secret_key();
+  auto encryptor_ = seal::Encryptor(context_, secret_key_);
+  auto decryptor_ = seal::Decryptor(context_, secret_key_);
+  size_t coeff_count = parms.poly_modulus_degree();
+  size_t poly_size = coeff_count * (parms.coeff_modulus().size() - 1);
+
+  std::vector<uint64_t> b(coeff_count);
+  b[0] = 1;
+  GSWMatrix b_gsw;
+  data_gsw.encrypt_plain_to_gsw(b, encryptor_, decryptor_, b_gsw);
+
+  size_t count = DatabaseConstants::ExternalProductBatch + 3;
+  std::vector<seal::Ciphertext> batch(count), single(count);
+  for (size_t i = 0; i < count; i++) {
+    seal::Plaintext a(coeff_count);
+    a[0] = i + 1;
+    encryptor_.encrypt_symmetric(a, batch[i]);
+    single[i] = batch[i];
+    data_gsw.external_product(b_gsw, single[i], coeff_count, single[i]);
+  }
+  ThreadPool pool(4);
+  data_gsw.external_product_batch(b_gsw, batch.data(), count, &pool);
+
+  size_t errors = 0;
+  for (size_t i = 0; i < count; i++) {
+    for (size_t k = 0; k < 2; k++) {
+      errors += !std::equal(batch[i].data(k), batch[i].data(k) + poly_size, single[i].data(k));
+    }
+  }
+  std::cout << "external_product_batch: " << (errors == 0 ? "Success!" : "Failure!") << std::endl;
+}
+
+// Recomposes every coefficient of a decomposed ciphertext from its digits and
+// checks it against the ciphertext in each RNS limb.
+void test_decomp_rlwe() {
+  PirParams pir_params(256, 2, 20000, 5, 15, 15);
+  const GSWEval &data_gsw = pir_params.get_data_gsw();
+  auto parms = pir_params.get_seal_params();
+  auto context_ = seal::SEALContext(parms);
+  auto keygen_ = seal::KeyGenerator(context_);
+  auto encryptor_ = seal::Encryptor(context_, keygen_.secret_key());
+  auto &coeff_modulus = context_.first_context_data()->parms().coeff_modulus();
+  size_t coeff_count = parms.poly_modulus_degree();
+  size_t l = data_gsw.l;
+
+  seal::Ciphertext ct;
+  encryptor_.encrypt_zero_symmetric(ct);
+  std::vector<std::vector<uint64_t>> decomposed;
+  data_gsw.decomp_rlwe(ct, decomposed);
+
+  size_t errors = 0;
+  for (size_t j = 0; j < 2; j++) {
+    for (size_t i = 0; i < coeff_modulus.size(); i++) {
+      uint128_t mod = coeff_modulus[i].value();
+      uint128_t base = (uint128_t(1) << data_gsw.base_log2) % mod;
+      for (size_t k = 0; k < coeff_count; k++) {
+        uint128_t value = 0;
+        for (size_t r = 0; r < l; r++) {
+          value = (value * base + decomposed[j * l + r][k + i * coeff_count]) % mod;
+        }
+        errors += static_cast<uint64_t>(value) != ct.data(j)[k + i * coeff_count];
+      }
+    }
+  }
+  std::cout << "decomp_rlwe: " << (errors == 0 ? "Success!" : "Failure!") << " (" << errors
+            << " mismatched coefficients)" << std::endl;
+}
+
+// Checks that workspace buffers are aligned, given back in stack order, and
+// that the arena grows to the peak use so the next query fits without the heap.
+void test_query_workspace() {
+  QueryWorkspace &workspace = QueryWorkspace::local();
+  workspace.reserve(1 << 10);
+  bool ok = true;
+  {
+    QueryWorkspace::Scope scope(workspace);
+    uint64_t *a = workspace.allocate<uint64_t>(10);
+    {
+      QueryWorkspace::Scope inner(workspace);
+      uint128_t *b = workspace.allocate<uint128_t>(1 << 10);
+      ok &= reinterpret_cast<uintptr_t>(b) % 64 == 0;
+    }
+    uint64_t *c = workspace.allocate<uint64_t>(1);
+    ok &= reinterpret_cast<uintptr_t>(a) % 64 == 0 && c == a + 16;
+  }
+  size_t capacity = workspace.capacity();
+  ok &= capacity >= (1 << 14);
+  {
+    QueryWorkspace::Scope scope(workspace);
+    workspace.allocate<uint128_t>(1 << 10);
+  }
+  ok &= workspace.capacity() == capacity;
+  std::cout << "QueryWorkspace: " << (ok ? "Success!" : "Failure!") << std::endl;
+}
+
+// Compares Barrett and Shoup reduction with 128-bit modulo for every
+// coefficient modulus, including accumulator-sized and full 128-bit inputs.
+void test_reduction() {
+  PirParams pir_params(256, 2, 20000, 5, 15, 15);
+  std::mt19937_64 rng(0);
+  size_t errors = 0;
+  for (auto &modulus : pir_params.get_seal_params().coeff_modulus()) {
+    utils::Reducer reducer(modulus);
+    uint64_t q = modulus.value();
+    for (int i = 0; i < 100000; i++) {
+      uint128_t x = (static_cast<uint128_t>(rng()) << 64) | rng();
+      if (i % 2 == 1) {
+        x >>= rng() % 128;
+      }
+      errors += reducer.reduce(x) != static_cast<uint64_t>(x % q);
+
+      uint64_t a = rng(), acc = rng() % q;
+      utils::ShoupOperand w = reducer.shoup(rng() % q);
+      uint64_t expected = static_cast<uint64_t>((static_cast<uint128_t>(a) * w.operand + acc) % q);
+      errors += reducer.multiply_add(a, w, acc) != expected;
+    }
+  }
+  std::cout << "Reduction: " << (errors == 0 ? "Success!" : "Failure!") << std::endl;
+}
+
+// Compares the kernels specialized for the first level and l with the
+// generic ones, and the shift with negacyclic_shift_poly_coeffmod.
+void test_kernels() {
+  PirParams pir_params(256, 2, 20000, 5, 15, 15);
+  const GSWEval &data_gsw = pir_params.get_data_gsw();
+  auto context = seal::SEALContext(pir_params.get_seal_params());
+  auto &parms = context.first_context_data()->parms();
+  auto &coeff_modulus = parms.coeff_modulus();
+  size_t coeff_count = parms.poly_modulus_degree();
+  size_t coeff_mod_count = coeff_modulus.size();
+  size_t poly_size = coeff_count * coeff_mod_count;
+  size_t l = data_gsw.l;
+  auto &specialized = kernels::select(coeff_count, coeff_mod_count, l);
+  auto &generic = kernels::generic();
+  std::cout << "Specialized kernels: " << (&specialized != &generic ? "yes" : "no") << std::endl;
+
+  std::mt19937_64 rng(0);
+  size_t errors = 0;
+  std::vector<uint64_t> poly(poly_size), expected(poly_size), scratch(coeff_count);
+  for (size_t shift : {size_t(0), size_t(1), coeff_count - 1, coeff_count, coeff_count + 5,
+                       2 * coeff_count - 1, size_t(0) - 1, size_t(0) - coeff_count}) {
+    for (size_t i = 0; i < poly_size; i++) {
+      poly[i] = rng() % coeff_modulus[i / coeff_count].value();
+    }
+    for (size_t j = 0; j < coeff_mod_count; j++) {
+      utils::negacyclic_shift_poly_coeffmod(poly.data() + j * coeff_count, coeff_count,
+                                            shift % (2 * coeff_count), coeff_modulus[j],
+                                            expected.data() + j * coeff_count);
+    }
+    specialized.negacyclic_shift(poly.data(), coeff_count, coeff_mod_count, shift,
+                                 coeff_modulus.data(), scratch.data());
+    errors += poly != expected;
+  }
+
+  std::vector<uint64_t> composed(poly_size), rows(l * poly_size), generic_rows(l * poly_size);
+  for (auto &word : composed) {
+    word = rng();
+  }
+  specialized.extract_digits(composed.data(), coeff_count, coeff_mod_count, l,
+                             data_gsw.base_log2, rows.data());
+  generic.extract_digits(composed.data(), coeff_count, coeff_mod_count, l, data_gsw.base_log2,
+                         generic_rows.data());
+  errors += rows != generic_rows;
+  std::cout << "Kernels: " << (errors == 0 ? "Success!" : "Failure!") << std::endl;
+}
+
+// Compares ExpansionKeys::apply_galois with SEAL's apply_galois for every
+// Galois element of the expansion tree, and times both.
+void test_expansion_keys() {
+  PirParams pir_params(1 << 10, 3, 1 << 10, 1000, 9, 9);
+  auto context = pir_params.get_data_gsw().context;
+  auto &parms = context->first_context_data()->parms();
+  size_t coeff_count = parms.poly_modulus_degree();
+  seal::KeyGenerator keygen(*context);
+  seal::Encryptor encryptor(*context, keygen.secret_key());
+  seal::Evaluator evaluator(*context);
+
+  std::vector<uint32_t> galois_elts;
+  for (size_t expansion_const = 1; expansion_const < coeff_count; expansion_const <<= 1) {
+    galois_elts.push_back(coeff_count / expansion_const + 1);
+  }
+  seal::GaloisKeys galois_keys;
+  keygen.create_galois_keys(galois_elts, galois_keys);
+  ExpansionKeys keys(context, galois_keys, galois_elts);
+
+  std::mt19937_64 rng(0);
+  seal::Plaintext plaintext(coeff_count);
+  for (size_t i = 0; i < coeff_count; i++) {
+    plaintext[i] = rng() % parms.plain_modulus().value();
+  }
+  seal::Ciphertext ciphertext;
+  encryptor.encrypt_symmetric(plaintext, ciphertext);
+  size_t ct_size = 2 * coeff_count * ciphertext.coeff_modulus_size();
+
+  size_t errors = 0;
+  std::chrono::microseconds seal_time(0), expansion_time(0);
+  for (uint32_t galois_elt : galois_elts) {
+    seal::Ciphertext expected, actual;
+    auto start_time = std::chrono::high_resolution_clock::now();
+    evaluator.apply_galois(ciphertext, galois_elt, galois_keys, expected);
+    auto mid_time = std::chrono::high_resolution_clock::now();
+    keys.apply_galois(ciphertext, galois_elt, actual);
+    auto end_time = std::chrono::high_resolution_clock::now();
+    seal_time += std::chrono::duration_cast<std::chrono::microseconds>(mid_time - start_time);
+    expansion_time += std::chrono::duration_cast<std::chrono::microseconds>(end_time - mid_time);
+    errors += !std::equal(expected.data(), expected.data() + ct_size, actual.data());
+  }
+  std::cout << "SEAL apply_galois: " << seal_time.count() << " us, ExpansionKeys: "
+            << expansion_time.count() << " us" << std::endl;
+  std::cout << "Expansion keys: " << (errors == 0 ? "Success!" : "Failure!") << std::endl;
+}
+
+// Compares every vectorized multiply_poly_acum kernel supported by this CPU
+// with the scalar one, including sizes that are not a multiple of the unroll
+// factor and accumulators that carry into their high 64 bits.
+void test_multiply_poly_acum() {
+  std::mt19937_64 rng(0);
+  bool success = true;
+  for (int operand_bits : {64, 52, 37}) {
+    auto variants = utils::multiply_poly_acum_variants(operand_bits);
+    for (size_t size : {8192, 1000, 33, 7}) {
+      std::vector<uint64_t> a(size), b(size);
+      std::vector<uint128_t> initial(size);
+      for (size_t i = 0; i < size; i++) {
+        a[i] = rng() >> (64 - operand_bits);
+        b[i] = rng() >> (64 - operand_bits);
+        initial[i] = (uint128_t(rng()) << 64) | rng();
+      }
+      std::vector<uint128_t> expected = initial;
+      for (int round = 0; round < 3; round++) {
+        utils::multiply_poly_acum_scalar(a.data(), b.data(), size, expected.data());
+      }
+      for (auto &[name, kernel] : variants) {
+        std::vector<uint128_t> result = initial;
+        for (int round = 0; round < 3; round++) {
+          kernel(a.data(), b.data(), size, result.data());
+        }
+        if (result != expected) {
+          std::cout << "multiply_poly_acum " << name << " mismatch for " << operand_bits
+                    << "-bit operands and size " << size << std::endl;
+          success = false;
+        }
+      }
+    }
+  }
+  std::cout << "multiply_poly_acum kernels:";
+  for (auto &variant : utils::multiply_poly_acum_variants(52)) {
+    std::cout << " " << variant.first;
+  }
+  std::cout << (success ? " - Success!" : " - Failure!") << std::endl;
+}
+
 Entry generate_entry(int id, int len) {
   Entry entry;
   std::mt19937 rng(id);
@@ -182,6 +476,574 @@ void test_pir() {
   }
 }
 
+void test_batch_pir() {
+  PirParams pir_params(1 << 10, 3, 1 << 10, 1000, 9, 9);
+  pir_params.print_values();
+  const int num_clients = 4;
+  PirServer server(pir_params);
+
+  std::vector<Entry> data(pir_params.get_num_entries());
+  for (int i = 0; i < pir_params.get_num_entries(); i++) {
+    data[i] = generate_entry(i, pir_params.get_entry_size());
+  }
+  server.set_database(data);
+  std::cout << "DB set" << std::endl;
+
+  std::vector<std::unique_ptr<PirClient>> clients;
+  for (int client_id = 0; client_id < num_clients; client_id++) {
+    clients.push_back(std::make_unique<PirClient>(pir_params));
+    server.set_client_galois_key(client_id, clients[client_id]->create_galois_keys());
+    server.set_client_gsw_key(client_id, clients[client_id]->generate_gsw_from_key());
+  }
+  std::cout << "Clients registered" << std::endl;
+
+  std::vector<int> ids;
+  std::vector<std::pair<uint32_t, PirQuery>> queries;
+  for (int client_id = 0; client_id < num_clients; client_id++) {
+    ids.push_back(rand() % pir_params.get_num_entries());
+    queries.emplace_back(client_id, clients[client_id]->generate_query(ids.back()));
+  }
+
+  auto start_time = std::chrono::high_resolution_clock::now();
+  auto results = server.make_queries(std::move(queries));
+  auto end_time = std::chrono::high_resolution_clock::now();
+  auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+  std::cout << "Server Time (" << num_clients << " queries): " << elapsed_time.count() << " ms"
+            << std::endl;
+
+  for (int client_id = 0; client_id < num_clients; client_id++) {
+    auto decrypted_result = clients[client_id]->decrypt_result(results[client_id]);
+    Entry entry = clients[client_id]->get_entry_from_plaintext(ids[client_id], decrypted_result[0]);
+    if (entry == data[ids[client_id]]) {
+      std::cout << "Success!" << std::endl;
+    } else {
+      std::cout << "Failure!" << std::endl;
+    }
+  }
+}
+
+// Answers the queries of several clients at once through a QueryExecutor.
+void test_concurrent_queries() {
+  PirParams pir_params(1 << 10, 3, 1 << 10, 1000, 9, 9);
+  const int num_clients = 8;
+  PirServer server(pir_params);
+
+  std::vector<Entry> data(pir_params.get_num_entries());
+  for (int i = 0; i < pir_params.get_num_entries(); i++) {
+    data[i] = generate_entry(i, pir_params.get_entry_size());
+  }
+  server.set_database(data);
+
+  std::vector<std::unique_ptr<PirClient>> clients;
+  for (int client_id = 0; client_id < num_clients; client_id++) {
+    clients.push_back(std::make_unique<PirClient>(pir_params));
+    server.set_client_galois_key(client_id, clients[client_id]->create_galois_keys());
+    server.set_client_gsw_key(client_id, clients[client_id]->generate_gsw_from_key());
+  }
+
+  QueryExecutor executor(server, 4);
+  std::vector<int> ids;
+  std::vector<std::future<std::vector<seal::Ciphertext>>> replies;
+  auto start_time = std::chrono::high_resolution_clock::now();
+  for (int client_id = 0; client_id < num_clients; client_id++) {
+    ids.push_back(rand() % pir_params.get_num_entries());
+    replies.push_back(executor.submit(client_id, clients[client_id]->generate_query(ids.back())));
+  }
+
+  bool success = true;
+  for (int client_id = 0; client_id < num_clients; client_id++) {
+    auto result = replies[client_id].get();
+    auto decrypted_result = clients[client_id]->decrypt_result(result);
+    Entry entry = clients[client_id]->get_entry_from_plaintext(ids[client_id], decrypted_result[0]);
+    success &= entry == data[ids[client_id]];
+  }
+  auto end_time = std::chrono::high_resolution_clock::now();
+  auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+  std::cout << "Server Time (" << num_clients << " concurrent queries): " << elapsed_time.count()
+            << " ms" << std::endl;
+
+  // A client without keys gets an exception from its future.
+  bool rejected = false;
+  try {
+    executor.submit(num_clients, clients[0]->generate_query(0)).get();
+  } catch (const std::invalid_argument &) {
+    rejected = true;
+  }
+  std::cout << "Concurrent queries: " << (success && rejected ? "Success!" : "Failure!")
+            << std::endl;
+}
+
+// Serves two tables with different entry sizes and l from one process, with
+// one thread pool.
+void test_multiple_params() {
+  PirParams small_params(1 << 10, 3, 1 << 12, 100, 9, 9);
+  PirParams large_params(1 << 10, 2, 1 << 10, 1000, 15, 9);
+  std::cout << "Shared SEALContext: "
+            << (small_params.get_data_gsw().context == large_params.get_data_gsw().context
+                    ? "yes"
+                    : "no")
+            << std::endl;
+
+  bool success = true;
+  auto pool = std::make_shared<ThreadPool>();
+  for (PirParams *pir_params : {&small_params, &large_params}) {
+    const int client_id = 0;
+    PirServer server(*pir_params);
+    server.set_thread_pool(pool);
+    std::vector<Entry> data(pir_params->get_num_entries());
+    for (int i = 0; i < pir_params->get_num_entries(); i++) {
+      data[i] = generate_entry(i, pir_params->get_entry_size());
+    }
+    server.set_database(data);
+
+    PirClient client(*pir_params);
+    server.set_client_galois_key(client_id, client.create_galois_keys());
+    server.set_client_gsw_key(client_id, client.generate_gsw_from_key());
+    int id = rand() % pir_params->get_num_entries();
+    auto result = server.make_query(client_id, client.generate_query(id));
+    auto decrypted_result = client.decrypt_result(result);
+    success &= client.get_entry_from_plaintext(id, decrypted_result[0]) == data[id];
+  }
+  std::cout << "Multiple params: " << (success ? "Success!" : "Failure!") << std::endl;
+}
+
+// Registers clients with a key store that keeps only the last one in memory,
+// so the others are spilled to disk and loaded back by their queries.
+void test_key_store() {
+  PirParams pir_params(1 << 10, 3, 1 << 10, 1000, 9, 9);
+  const int num_clients = 3;
+  PirServer server(pir_params);
+  std::vector<Entry> data(pir_params.get_num_entries());
+  for (int i = 0; i < pir_params.get_num_entries(); i++) {
+    data[i] = generate_entry(i, pir_params.get_entry_size());
+  }
+  server.set_database(data);
+
+  char spill_dir[] = "/tmp/onionpir_keys_XXXXXX";
+  if (mkdtemp(spill_dir) == nullptr) {
+    throw std::runtime_error("Cannot create a spill directory");
+  }
+  auto key_store =
+      std::make_shared<ClientKeyStore>(pir_params.get_data_gsw().context, 1, spill_dir);
+  server.set_key_store(key_store);
+
+  std::vector<std::unique_ptr<PirClient>> clients;
+  for (int client_id = 0; client_id < num_clients; client_id++) {
+    clients.push_back(std::make_unique<PirClient>(pir_params));
+    server.set_client_galois_key(client_id, clients[client_id]->create_galois_keys());
+    server.set_client_gsw_key(client_id, clients[client_id]->generate_gsw_from_key());
+  }
+
+  bool success = true;
+  for (int client_id = 0; client_id < num_clients; client_id++) {
+    int id = rand() % pir_params.get_num_entries();
+    auto result = server.make_query(client_id, clients[client_id]->generate_query(id));
+    auto decrypted_result = clients[client_id]->decrypt_result(result);
+    success &= clients[client_id]->get_entry_from_plaintext(id, decrypted_result[0]) == data[id];
+  }
+
+  auto stats = key_store->stats();
+  std::cout << "Key store: " << stats.hits << " hits, " << stats.misses << " misses, "
+            << stats.loads << " loads, " << stats.evictions << " evictions, "
+            << stats.resident_clients << " resident clients" << std::endl;
+  success &= stats.loads > 0 && stats.evictions > 0 && stats.resident_clients == 1 &&
+             stats.spill_failures == 0;
+  for (int client_id = 0; client_id < num_clients; client_id++) {
+    key_store->erase(client_id);
+  }
+  rmdir(spill_dir);
+  std::cout << "Key store: " << (success ? "Success!" : "Failure!") << std::endl;
+}
+
+// Loads a client from its spill file while another client of the same shard
+// has a key set over and over. Every lookup of the first client must find both
+// of its keys, and a query must still succeed afterwards.
+void test_key_store_concurrent_load() {
+  PirParams pir_params(1 << 10, 3, 1 << 10, 1000, 9, 9);
+  PirServer server(pir_params);
+  std::vector<Entry> data(pir_params.get_num_entries());
+  for (int i = 0; i < pir_params.get_num_entries(); i++) {
+    data[i] = generate_entry(i, pir_params.get_entry_size());
+  }
+  server.set_database(data);
+
+  char spill_dir[] = "/tmp/onionpir_keys_XXXXXX";
+  if (mkdtemp(spill_dir) == nullptr) {
+    throw std::runtime_error("Cannot create a spill directory");
+  }
+  // With a budget of one byte, each client evicts the other.
+  auto key_store =
+      std::make_shared<ClientKeyStore>(pir_params.get_data_gsw().context, 1, spill_dir);
+  server.set_key_store(key_store);
+
+  // Clients whose ids are equal modulo the number of shards share a shard.
+  const uint32_t loaded_id = 1, updated_id = 65;
+  PirClient loaded_client(pir_params), updated_client(pir_params);
+  server.set_client_galois_key(loaded_id, loaded_client.create_galois_keys());
+  server.set_client_gsw_key(loaded_id, loaded_client.generate_gsw_from_key());
+  GSWMatrix updated_key = updated_client.generate_gsw_from_key();
+
+  const int rounds = 200;
+  std::thread setter([&]() {
+    for (int i = 0; i < rounds; i++) {
+      key_store->set_gsw_key(updated_id, updated_key);
+    }
+  });
+  bool success = true;
+  for (int i = 0; i < rounds; i++) {
+    success &= key_store->expansion_keys(loaded_id) != nullptr;
+    success &= key_store->gsw_key(loaded_id) != nullptr;
+  }
+  setter.join();
+
+  int id = rand() % pir_params.get_num_entries();
+  auto result = server.make_query(loaded_id, loaded_client.generate_query(id));
+  auto decrypted_result = loaded_client.decrypt_result(result);
+  success &= loaded_client.get_entry_from_plaintext(id, decrypted_result[0]) == data[id];
+
+  auto stats = key_store->stats();
+  std::cout << "Key store: " << stats.loads << " loads, " << stats.evictions << " evictions"
+            << std::endl;
+  key_store->erase(loaded_id);
+  key_store->erase(updated_id);
+  rmdir(spill_dir);
+  std::cout << "Key store concurrent load: " << (success ? "Success!" : "Failure!") << std::endl;
+}
+
+// Runs a query with every message between client and server going through
+// the wire format, and prints the size of each message.
+void test_serialization() {
+  PirParams server_params(1 << 10, 3, 1 << 10, 1000, 9, 9);
+  const int client_id = 0;
+  PirServer server(server_params);
+  std::vector<Entry> data(server_params.get_num_entries());
+  for (int i = 0; i < server_params.get_num_entries(); i++) {
+    data[i] = generate_entry(i, server_params.get_entry_size());
+  }
+  server.set_database(data);
+
+  std::vector<uint8_t> params_message;
+  serialization::write_params(server_params, params_message);
+  PirParams pir_params = serialization::read_params(params_message.data(), params_message.size());
+  PirClient client(pir_params);
+  int id = rand() % pir_params.get_num_entries();
+
+  std::vector<uint8_t> upload;
+  serialization::MessageWriter client_writer(pir_params, upload);
+  client_writer.write_galois_keys(client.create_seeded_galois_keys());
+  size_t galois_bytes = upload.size();
+  client_writer.write_gsw_key(client.generate_gsw_from_key());
+  size_t gsw_bytes = upload.size() - galois_bytes;
+  client_writer.write_query(client.generate_seeded_query(id));
+  size_t query_bytes = upload.size() - galois_bytes - gsw_bytes;
+
+  serialization::MessageReader server_reader(server_params, upload.data(), upload.size());
+  seal::GaloisKeys galois_keys;
+  GSWMatrix gsw_key;
+  PirQuery query;
+  server_reader.read_galois_keys(galois_keys);
+  server_reader.read_gsw_key(gsw_key);
+  server_reader.read_query(query);
+  server.set_client_galois_key(client_id, std::move(galois_keys));
+  server.set_client_gsw_key(client_id, std::move(gsw_key));
+  auto result = server.make_query(client_id, std::move(query));
+
+  std::vector<uint8_t> download;
+  serialization::MessageWriter server_writer(server_params, download);
+  server_writer.write_response(result);
+  serialization::MessageReader client_reader(pir_params, download.data(), download.size());
+  std::vector<seal::Ciphertext> reply;
+  client_reader.read_response(reply);
+
+  std::cout << "Params: " << params_message.size() << " bytes, Galois keys: " << galois_bytes
+            << " bytes, GSW key: " << gsw_bytes << " bytes, query: " << query_bytes
+            << " bytes, response: " << download.size() << " bytes" << std::endl;
+  bool success = server_reader.done() && client_reader.done() &&
+                 client.get_entry_from_plaintext(id, client.decrypt_result(reply)[0]) == data[id];
+  std::cout << "Serialization: " << (success ? "Success!" : "Failure!") << std::endl;
+}
+
+// Answers the same query from a server with each database layout.
+void test_database_layouts() {
+  PirParams pir_params(1 << 10, 3, 1 << 10, 1000, 9, 9);
+  const int client_id = 0;
+  std::vector<Entry> data(pir_params.get_num_entries());
+  for (int i = 0; i < pir_params.get_num_entries(); i++) {
+    data[i] = generate_entry(i, pir_params.get_entry_size());
+  }
+
+  PirClient client(pir_params);
+  int id = rand() % pir_params.get_num_entries();
+  for (auto layout : {DatabaseLayout::Plaintexts, DatabaseLayout::Tiled, DatabaseLayout::Compact}) {
+    PirServer server(pir_params);
+    server.set_database_layout(layout);
+    server.set_database(data);
+    server.decryptor_ = client.get_decryptor();
+    server.set_client_galois_key(client_id, client.create_galois_keys());
+    server.set_client_gsw_key(client_id, client.generate_gsw_from_key());
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    auto result = server.make_query(client_id, client.generate_query(id));
+    auto end_time = std::chrono::high_resolution_clock::now();
+    auto elapsed_time =
+        std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+    Entry entry = client.get_entry_from_plaintext(id, client.decrypt_result(result)[0]);
+    std::cout << "Layout " << static_cast<int>(layout) << ": " << elapsed_time.count() << " ms, "
+              << (entry == data[id] ? "Success!" : "Failure!") << std::endl;
+  }
+}
+
+// Updates a few entries in place and checks that queries return the new data
+// with each database layout.
+void test_update_entries() {
+  PirParams pir_params(1 << 10, 3, 1 << 10, 1000, 9, 9);
+  const int client_id = 0;
+  std::vector<Entry> data(pir_params.get_num_entries());
+  for (int i = 0; i < pir_params.get_num_entries(); i++) {
+    data[i] = generate_entry(i, pir_params.get_entry_size());
+  }
+
+  PirClient client(pir_params);
+  for (auto layout : {DatabaseLayout::Plaintexts, DatabaseLayout::Tiled, DatabaseLayout::Compact}) {
+    PirServer server(pir_params);
+    server.set_database_layout(layout);
+    server.set_database(data);
+    server.decryptor_ = client.get_decryptor();
+    server.set_client_galois_key(client_id, client.create_galois_keys());
+    server.set_client_gsw_key(client_id, client.generate_gsw_from_key());
+
+    std::vector<std::pair<size_t, Entry>> updates;
+    for (int k = 0; k < 4; k++) {
+      size_t id = rand() % pir_params.get_num_entries();
+      updates.emplace_back(id, generate_entry(id + pir_params.get_num_entries(),
+                                              pir_params.get_entry_size()));
+    }
+    auto start_time = std::chrono::high_resolution_clock::now();
+    server.update_entries(updates);
+    auto end_time = std::chrono::high_resolution_clock::now();
+    auto elapsed_time =
+        std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
+    std::cout << "Update time: " << elapsed_time.count() << " us" << std::endl;
+
+    // Checks an updated entry and, when it shares its plaintext, its neighbour.
+    size_t id = updates.back().first;
+    size_t neighbour = id ^ 1;
+    for (size_t query_id : {id, neighbour}) {
+      Entry expected = data[query_id];
+      for (auto &update : updates) {
+        if (update.first == query_id) {
+          expected = update.second;
+        }
+      }
+      auto result = server.make_query(client_id, client.generate_query(query_id));
+      Entry entry = client.get_entry_from_plaintext(query_id, client.decrypt_result(result)[0]);
+      std::cout << "Layout " << static_cast<int>(layout) << ": "
+                << (entry == expected ? "Success!" : "Failure!") << std::endl;
+    }
+  }
+}
+
+// Publishes new versions of the database in the background while queries
+// run, and checks that each query sees either the old or the new entry.
+void test_database_snapshots() {
+  PirParams pir_params(1 << 10, 3, 1 << 10, 1000, 9, 9);
+  const int client_id = 0;
+  std::vector<Entry> data(pir_params.get_num_entries());
+  for (int i = 0; i < pir_params.get_num_entries(); i++) {
+    data[i] = generate_entry(i, pir_params.get_entry_size());
+  }
+
+  PirClient client(pir_params);
+  PirServer server(pir_params);
+  server.set_database(data);
+  server.decryptor_ = client.get_decryptor();
+  server.set_client_galois_key(client_id, client.create_galois_keys());
+  server.set_client_gsw_key(client_id, client.generate_gsw_from_key());
+
+  size_t id = rand() % pir_params.get_num_entries();
+  Entry new_entry = generate_entry(id + pir_params.get_num_entries(), pir_params.get_entry_size());
+  for (int round = 0; round < 4; round++) {
+    std::vector<std::pair<size_t, Entry>> updates;
+    updates.emplace_back(id, round % 2 == 0 ? new_entry : data[id]);
+    auto update = server.update_entries_async(std::move(updates));
+    auto result = server.make_query(client_id, client.generate_query(id));
+    uint64_t version = update.get();
+    Entry entry = client.get_entry_from_plaintext(id, client.decrypt_result(result)[0]);
+    std::cout << "Version " << version << ": "
+              << (entry == data[id] || entry == new_entry ? "Success!" : "Failure!") << std::endl;
+  }
+
+  auto start_time = std::chrono::high_resolution_clock::now();
+  auto refresh = server.set_database_async(data);
+  auto result = server.make_query(client_id, client.generate_query(id));
+  auto end_time = std::chrono::high_resolution_clock::now();
+  auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+  std::cout << "Query time during refresh: " << elapsed_time.count() << " ms" << std::endl;
+  refresh.get();
+  result = server.make_query(client_id, client.generate_query(id));
+  Entry entry = client.get_entry_from_plaintext(id, client.decrypt_result(result)[0]);
+  std::cout << "Version " << server.get_database_version() << ": "
+            << (entry == data[id] ? "Success!" : "Failure!") << std::endl;
+}
+
+// Saves a database, maps it into a second server and checks that both answer
+// a query correctly.
+void test_database_file() {
+  PirParams pir_params(1 << 10, 3, 1 << 10, 1000, 9, 9);
+  const int client_id = 0;
+  const std::string path = "test_database.bin";
+  PirServer server(pir_params), loaded_server(pir_params);
+
+  std::vector<Entry> data(pir_params.get_num_entries());
+  for (int i = 0; i < pir_params.get_num_entries(); i++) {
+    data[i] = generate_entry(i, pir_params.get_entry_size());
+  }
+  server.set_database(data);
+  server.save_database(path);
+
+  auto start_time = std::chrono::high_resolution_clock::now();
+  loaded_server.load_database(path);
+  auto end_time = std::chrono::high_resolution_clock::now();
+  auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+  std::cout << "Database load time: " << elapsed_time.count() << " ms" << std::endl;
+
+  PirClient client(pir_params);
+  for (PirServer *s : {&server, &loaded_server}) {
+    s->decryptor_ = client.get_decryptor();
+    s->set_client_galois_key(client_id, client.create_galois_keys());
+    s->set_client_gsw_key(client_id, client.generate_gsw_from_key());
+    int id = rand() % pir_params.get_num_entries();
+    auto result = s->make_query(client_id, client.generate_query(id));
+    Entry entry = client.get_entry_from_plaintext(id, client.decrypt_result(result)[0]);
+    std::cout << (entry == data[id] ? "Success!" : "Failure!") << std::endl;
+  }
+
+  // Same sizes, other entry packing: the file must be refused.
+  PirServer dense_server(PirParams(1 << 10, 3, 1 << 10, 1000, 9, 9, EntryPacking::Dense));
+  bool rejected = false;
+  try {
+    dense_server.load_database(path);
+  } catch (const std::invalid_argument &) {
+    rejected = true;
+  }
+  std::cout << "Other packing: " << (rejected ? "Success!" : "Failure!") << std::endl;
+  std::remove(path.c_str());
+}
+
+// Writes the entries to a flat file, streams it into servers of every layout
+// and checks a query against the entries.
+void test_database_streaming() {
+  PirParams pir_params(1 << 10, 3, 1 << 10, 1000, 9, 9);
+  const int client_id = 0;
+  const std::string path = "test_entries.bin";
+  std::vector<Entry> data(pir_params.get_num_entries());
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    for (int i = 0; i < pir_params.get_num_entries(); i++) {
+      data[i] = generate_entry(i, pir_params.get_entry_size());
+      out.write(reinterpret_cast<const char *>(data[i].data()), data[i].size());
+    }
+  }
+
+  PirClient client(pir_params);
+  int id = rand() % pir_params.get_num_entries();
+  for (auto layout : {DatabaseLayout::Plaintexts, DatabaseLayout::Tiled, DatabaseLayout::Compact}) {
+    PirServer server(pir_params);
+    server.set_database_layout(layout);
+    auto start_time = std::chrono::high_resolution_clock::now();
+    server.set_database_from_file(path);
+    auto end_time = std::chrono::high_resolution_clock::now();
+    auto elapsed_time =
+        std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+
+    server.decryptor_ = client.get_decryptor();
+    server.set_client_galois_key(client_id, client.create_galois_keys());
+    server.set_client_gsw_key(client_id, client.generate_gsw_from_key());
+    auto result = server.make_query(client_id, client.generate_query(id));
+    Entry entry = client.get_entry_from_plaintext(id, client.decrypt_result(result)[0]);
+    std::cout << "Layout " << static_cast<int>(layout) << ": ingestion " << elapsed_time.count()
+              << " ms, " << (entry == data[id] ? "Success!" : "Failure!") << std::endl;
+  }
+  std::remove(path.c_str());
+}
+
+// Packs 7000 byte entries densely, which fits 1.75 entries per plaintext
+// instead of 1, and retrieves and updates an entry spanning two plaintexts.
+void test_dense_packing() {
+  PirParams pir_params(1 << 10, 3, 1700, 7000, 9, 9, EntryPacking::Dense);
+  pir_params.print_values();
+  const int client_id = 0;
+  std::vector<Entry> data(pir_params.get_num_entries());
+  for (int i = 0; i < pir_params.get_num_entries(); i++) {
+    data[i] = generate_entry(i, pir_params.get_entry_size());
+  }
+
+  PirClient client(pir_params);
+  PirServer server(pir_params);
+  server.set_database(data);
+  server.decryptor_ = client.get_decryptor();
+  server.set_client_galois_key(client_id, client.create_galois_keys());
+  server.set_client_gsw_key(client_id, client.generate_gsw_from_key());
+
+  size_t id = rand() % pir_params.get_num_entries();
+  while (pir_params.get_entry_plaintexts(id).second != 2) {
+    id = (id + 1) % pir_params.get_num_entries();
+  }
+  for (int round = 0; round < 2; round++) {
+    std::vector<std::pair<uint32_t, PirQuery>> queries;
+    for (auto &query : client.generate_entry_queries(id)) {
+      queries.emplace_back(client_id, std::move(query));
+    }
+    auto results = server.make_queries(std::move(queries));
+    std::vector<seal::Plaintext> plaintexts;
+    for (auto &result : results) {
+      plaintexts.push_back(client.decrypt_result(result)[0]);
+    }
+    Entry entry = client.get_entry_from_plaintexts(id, plaintexts);
+    std::cout << "Entry " << id << " over " << plaintexts.size() << " plaintexts: "
+              << (entry == data[id] ? "Success!" : "Failure!") << std::endl;
+
+    data[id] = generate_entry(id + pir_params.get_num_entries(), pir_params.get_entry_size());
+    server.update_entries({{id, data[id]}});
+  }
+}
+
+// Answers the same query with each query expansion mode.
+void test_expansion_modes() {
+  PirParams pir_params(1 << 10, 3, 1 << 10, 1000, 9, 9);
+  const int client_id = 0;
+  std::vector<Entry> data(pir_params.get_num_entries());
+  for (int i = 0; i < pir_params.get_num_entries(); i++) {
+    data[i] = generate_entry(i, pir_params.get_entry_size());
+  }
+
+  PirClient client(pir_params);
+  PirServer server(pir_params);
+  server.decryptor_ = client.get_decryptor();
+  server.set_client_galois_key(client_id, client.create_galois_keys());
+  server.set_client_gsw_key(client_id, client.generate_gsw_from_key());
+
+  int id = rand() % pir_params.get_num_entries();
+  for (auto layout : {DatabaseLayout::Plaintexts, DatabaseLayout::Tiled}) {
+    server.set_database_layout(layout);
+    server.set_database(data);
+    for (auto mode : {ExpansionMode::Copy, ExpansionMode::InPlace, ExpansionMode::Streaming}) {
+      server.set_expansion_mode(mode);
+      QueryWorkspace::reset_total_peak();
+      auto start_time = std::chrono::high_resolution_clock::now();
+      auto result = server.make_query(client_id, client.generate_query(id));
+      auto end_time = std::chrono::high_resolution_clock::now();
+      auto elapsed_time =
+          std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+      Entry entry = client.get_entry_from_plaintext(id, client.decrypt_result(result)[0]);
+      std::cout << "Layout " << static_cast<int>(layout) << ", expansion mode "
+                << static_cast<int>(mode) << ": " << elapsed_time.count() << " ms, "
+                << QueryWorkspace::total_peak() / 1024 << " KB peak workspace, "
+                << (entry == data[id] ? "Success!" : "Failure!") << std::endl;
+    }
+  }
+}
+
 void test_keyword_pir() {
   int table_size = 1 << 15;
   PirParams pir_params(table_size, 8, table_size, 12000, 9, 9);
@@ -0,0 +1,105 @@
+#include "thread_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+
+ThreadPool::ThreadPool(size_t num_threads) {
+  // The calling thread is one of the num_threads.
+  for (size_t i = 1; i < num_threads; i++) {
+    workers_.emplace_back([this]() { worker_loop(); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+}
+
+size_t ThreadPool::size() const { return workers_.size() + 1; }
+
+void ThreadPool::enqueue(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push(std::move(task));
+  }
+  cv_.notify_one();
+}
+
+void ThreadPool::worker_loop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+      if (tasks_.empty()) {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop();
+    }
+    task();
+  }
+}
+
+void ThreadPool::parallel_for(size_t begin, size_t end, const std::function<void(size_t)> &fn) {
+  if (end <= begin) {
+    return;
+  }
+  size_t count = end - begin;
+  size_t num_helpers = std::min(workers_.size(), count - 1);
+  if (num_helpers == 0) {
+    for (size_t i = begin; i < end; i++) {
+      fn(i);
+    }
+    return;
+  }
+
+  // Indices are handed out through a shared counter. A helper that is only scheduled after all
+  // indices are taken exits without touching fn, so the state must outlive this call but fn
+  // does not.
+  struct State {
+    std::atomic<size_t> next;
+    std::atomic<size_t> done{0};
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::exception_ptr error;
+  };
+  auto state = std::make_shared<State>();
+  state->next = begin;
+
+  const std::function<void(size_t)> *fn_ptr = &fn;
+  auto run = [state, fn_ptr, end, count]() {
+    size_t i;
+    while ((i = state->next.fetch_add(1)) < end) {
+      try {
+        (*fn_ptr)(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (!state->error) {
+          state->error = std::current_exception();
+        }
+      }
+      if (state->done.fetch_add(1) + 1 == count) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->cv.notify_all();
+      }
+    }
+  };
+
+  for (size_t i = 0; i < num_helpers; i++) {
+    enqueue(run);
+  }
+  run();
+
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->cv.wait(lock, [&]() { return state->done.load() == count; });
+  if (state->error) {
+    std::rethrow_exception(state->error);
+  }
+}
@@ -1,4 +1,105 @@
 #include "utils.h"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+utils::MappedFile::MappedFile(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Cannot open " + path);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error("Cannot stat " + path);
+  }
+  size_ = st.st_size;
+  void *ptr = size_ > 0 ? mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    throw std::runtime_error("Cannot map " + path);
+  }
+  data_ = static_cast<const uint8_t *>(ptr);
+}
+
+utils::MappedFile::~MappedFile() {
+  if (data_ != nullptr) {
+    munmap(const_cast<uint8_t *>(data_), size_);
+  }
+}
+
+void utils::pack_coeffs(const uint64_t *coeffs, size_t count, size_t bits, uint64_t *packed) {
+  const uint64_t mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+  size_t bit_pos = 0;
+  for (size_t i = 0; i < count; i++, bit_pos += bits) {
+    uint64_t value = coeffs[i] & mask;
+    size_t word = bit_pos / 64, shift = bit_pos % 64;
+    packed[word] |= value << shift;
+    if (shift + bits > 64) {
+      packed[word + 1] |= value >> (64 - shift);
+    }
+  }
+}
+
+void utils::unpack_coeffs(const uint64_t *packed, size_t count, size_t bits, uint64_t *coeffs) {
+  const uint64_t mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+  size_t bit_pos = 0;
+  for (size_t i = 0; i < count; i++, bit_pos += bits) {
+    size_t word = bit_pos / 64, shift = bit_pos % 64;
+    uint64_t value = packed[word] >> shift;
+    if (shift + bits > 64) {
+      value |= packed[word + 1] << (64 - shift);
+    }
+    coeffs[i] = value & mask;
+  }
+}
+
+size_t utils::bytes_to_coeffs(const uint8_t *bytes, size_t num_bytes, size_t bits,
+                             uint64_t *coeffs) {
+  const uint64_t mask = (1ULL << bits) - 1;
+  // Holds fewer than bits pending bits before each load, so a loaded word
+  // always fits.
+  uint128_t buffer = 0;
+  size_t buffer_bits = 0, count = 0;
+  for (size_t pos = 0; pos < num_bytes; pos += 8) {
+    uint64_t word = 0;
+    size_t n = std::min<size_t>(8, num_bytes - pos);
+    // Assumes a little-endian host, like the database file format.
+    std::memcpy(&word, bytes + pos, n);
+    buffer |= uint128_t(word) << buffer_bits;
+    buffer_bits += n * 8;
+    while (buffer_bits >= bits) {
+      coeffs[count++] = static_cast<uint64_t>(buffer) & mask;
+      buffer >>= bits;
+      buffer_bits -= bits;
+    }
+  }
+  if (buffer_bits > 0) {
+    coeffs[count++] = static_cast<uint64_t>(buffer) & mask;
+  }
+  return count;
+}
+
+void utils::write_entry_bits(const uint8_t *entry, size_t entry_size, size_t bit_offset,
+                             size_t bits_per_coeff, uint64_t *coeffs) {
+  for (size_t k = 0; k < entry_size * 8; k += 8) {
+    size_t coeff_id = (bit_offset + k) / bits_per_coeff;
+    size_t shift = (bit_offset + k) % bits_per_coeff;
+    uint64_t byte = entry[k / 8];
+    // The byte may continue into the next coefficient.
+    size_t bits_here = std::min<size_t>(8, bits_per_coeff - shift);
+    uint64_t mask_here = ((1ULL << bits_here) - 1) << shift;
+    coeffs[coeff_id] = (coeffs[coeff_id] & ~mask_here) | ((byte << shift) & mask_here);
+    if (bits_here < 8) {
+      uint64_t mask_next = (1ULL << (8 - bits_here)) - 1;
+      coeffs[coeff_id + 1] = (coeffs[coeff_id + 1] & ~mask_next) | (byte >> bits_here);
+    }
+  }
+}
 
 void utils::negacyclic_shift_poly_coeffmod(seal::util::ConstCoeffIter poly, size_t coeff_count,
                                            size_t shift, const seal::Modulus &modulus,
@@ -34,3 +135,187 @@ void utils::shift_polynomial(seal::EncryptionParameters &params, seal::Ciphertex
     }
   }
 }
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+// The vector kernels keep each 128-bit accumulator as a (low, high) pair of
+// 64-bit lanes. A product is added to the low lane, and the carry out of it is
+// added to the high lane.
+
+__attribute__((target("avx2"))) void utils::multiply_poly_acum_avx2(const uint64_t *ct_ptr,
+                                                                    const uint64_t *pt_ptr,
+                                                                    size_t size,
+                                                                    uint128_t *result) {
+  const __m256i low32 = _mm256_set1_epi64x(0xFFFFFFFF);
+  const __m256i sign = _mm256_set1_epi64x(static_cast<long long>(1ULL << 63));
+  size_t cc = 0;
+  for (; cc + 4 <= size; cc += 4) {
+    // Lanes are ordered 0, 2, 1, 3 to match the unpack of the accumulators.
+    __m256i a = _mm256_permute4x64_epi64(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ct_ptr + cc)), 0xD8);
+    __m256i b = _mm256_permute4x64_epi64(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pt_ptr + cc)), 0xD8);
+    __m256i a_hi = _mm256_srli_epi64(a, 32);
+    __m256i b_hi = _mm256_srli_epi64(b, 32);
+
+    // 64x64 -> 128 bit product from four 32x32 -> 64 bit products.
+    __m256i p_ll = _mm256_mul_epu32(a, b);
+    __m256i p_lh = _mm256_mul_epu32(a, b_hi);
+    __m256i p_hl = _mm256_mul_epu32(a_hi, b);
+    __m256i p_hh = _mm256_mul_epu32(a_hi, b_hi);
+    __m256i t = _mm256_add_epi64(p_hl, _mm256_srli_epi64(p_ll, 32));
+    __m256i u = _mm256_add_epi64(p_lh, _mm256_and_si256(t, low32));
+    __m256i prod_lo = _mm256_or_si256(_mm256_slli_epi64(u, 32), _mm256_and_si256(p_ll, low32));
+    __m256i prod_hi = _mm256_add_epi64(
+        p_hh, _mm256_add_epi64(_mm256_srli_epi64(t, 32), _mm256_srli_epi64(u, 32)));
+
+    __m256i *acc_ptr = reinterpret_cast<__m256i *>(result + cc);
+    __m256i acc0 = _mm256_loadu_si256(acc_ptr);
+    __m256i acc1 = _mm256_loadu_si256(acc_ptr + 1);
+    __m256i acc_lo = _mm256_unpacklo_epi64(acc0, acc1);
+    __m256i acc_hi = _mm256_unpackhi_epi64(acc0, acc1);
+
+    acc_lo = _mm256_add_epi64(acc_lo, prod_lo);
+    // Unsigned acc_lo < prod_lo, computed as a signed compare with the sign bit flipped.
+    __m256i carry = _mm256_cmpgt_epi64(_mm256_xor_si256(prod_lo, sign),
+                                       _mm256_xor_si256(acc_lo, sign));
+    acc_hi = _mm256_sub_epi64(_mm256_add_epi64(acc_hi, prod_hi), carry);
+
+    _mm256_storeu_si256(acc_ptr, _mm256_unpacklo_epi64(acc_lo, acc_hi));
+    _mm256_storeu_si256(acc_ptr + 1, _mm256_unpackhi_epi64(acc_lo, acc_hi));
+  }
+  multiply_poly_acum_scalar(ct_ptr + cc, pt_ptr + cc, size - cc, result + cc);
+}
+
+namespace {
+// Splits eight 128-bit accumulators into their low and high halves.
+__attribute__((target("avx512f"))) inline void load_acc_avx512(const uint128_t *acc,
+                                                               __m512i &acc_lo,
+                                                               __m512i &acc_hi) {
+  const __m512i even = _mm512_setr_epi64(0, 2, 4, 6, 8, 10, 12, 14);
+  const __m512i odd = _mm512_setr_epi64(1, 3, 5, 7, 9, 11, 13, 15);
+  __m512i acc0 = _mm512_loadu_si512(acc);
+  __m512i acc1 = _mm512_loadu_si512(acc + 4);
+  acc_lo = _mm512_permutex2var_epi64(acc0, even, acc1);
+  acc_hi = _mm512_permutex2var_epi64(acc0, odd, acc1);
+}
+
+// Adds a 128-bit product to the accumulators and stores them back.
+__attribute__((target("avx512f"))) inline void add_store_acc_avx512(uint128_t *acc,
+                                                                    __m512i acc_lo,
+                                                                    __m512i acc_hi,
+                                                                    __m512i prod_lo,
+                                                                    __m512i prod_hi) {
+  const __m512i first = _mm512_setr_epi64(0, 8, 1, 9, 2, 10, 3, 11);
+  const __m512i second = _mm512_setr_epi64(4, 12, 5, 13, 6, 14, 7, 15);
+  acc_lo = _mm512_add_epi64(acc_lo, prod_lo);
+  __mmask8 carry = _mm512_cmplt_epu64_mask(acc_lo, prod_lo);
+  acc_hi = _mm512_add_epi64(acc_hi, prod_hi);
+  acc_hi = _mm512_mask_add_epi64(acc_hi, carry, acc_hi, _mm512_set1_epi64(1));
+  _mm512_storeu_si512(acc, _mm512_permutex2var_epi64(acc_lo, first, acc_hi));
+  _mm512_storeu_si512(acc + 4, _mm512_permutex2var_epi64(acc_lo, second, acc_hi));
+}
+} // namespace
+
+__attribute__((target("avx512f"))) void utils::multiply_poly_acum_avx512(const uint64_t *ct_ptr,
+                                                                         const uint64_t *pt_ptr,
+                                                                         size_t size,
+                                                                         uint128_t *result) {
+  const __m512i low32 = _mm512_set1_epi64(0xFFFFFFFF);
+  size_t cc = 0;
+  for (; cc + 8 <= size; cc += 8) {
+    __m512i a = _mm512_loadu_si512(ct_ptr + cc);
+    __m512i b = _mm512_loadu_si512(pt_ptr + cc);
+    __m512i a_hi = _mm512_srli_epi64(a, 32);
+    __m512i b_hi = _mm512_srli_epi64(b, 32);
+
+    __m512i p_ll = _mm512_mul_epu32(a, b);
+    __m512i p_lh = _mm512_mul_epu32(a, b_hi);
+    __m512i p_hl = _mm512_mul_epu32(a_hi, b);
+    __m512i p_hh = _mm512_mul_epu32(a_hi, b_hi);
+    __m512i t = _mm512_add_epi64(p_hl, _mm512_srli_epi64(p_ll, 32));
+    __m512i u = _mm512_add_epi64(p_lh, _mm512_and_si512(t, low32));
+    __m512i prod_lo = _mm512_or_si512(_mm512_slli_epi64(u, 32), _mm512_and_si512(p_ll, low32));
+    __m512i prod_hi = _mm512_add_epi64(
+        p_hh, _mm512_add_epi64(_mm512_srli_epi64(t, 32), _mm512_srli_epi64(u, 32)));
+
+    __m512i acc_lo, acc_hi;
+    load_acc_avx512(result + cc, acc_lo, acc_hi);
+    add_store_acc_avx512(result + cc, acc_lo, acc_hi, prod_lo, prod_hi);
+  }
+  multiply_poly_acum_scalar(ct_ptr + cc, pt_ptr + cc, size - cc, result + cc);
+}
+
+__attribute__((target("avx512f,avx512ifma"))) void
+utils::multiply_poly_acum_avx512ifma(const uint64_t *ct_ptr, const uint64_t *pt_ptr, size_t size,
+                                     uint128_t *result) {
+  const __m512i zero = _mm512_setzero_si512();
+  size_t cc = 0;
+  for (; cc + 8 <= size; cc += 8) {
+    __m512i a = _mm512_loadu_si512(ct_ptr + cc);
+    __m512i b = _mm512_loadu_si512(pt_ptr + cc);
+    // For 52-bit operands the product is lo52 + hi52 * 2^52.
+    __m512i lo52 = _mm512_madd52lo_epu64(zero, a, b);
+    __m512i hi52 = _mm512_madd52hi_epu64(zero, a, b);
+    __m512i prod_lo = _mm512_or_si512(lo52, _mm512_slli_epi64(hi52, 52));
+    __m512i prod_hi = _mm512_srli_epi64(hi52, 12);
+
+    __m512i acc_lo, acc_hi;
+    load_acc_avx512(result + cc, acc_lo, acc_hi);
+    add_store_acc_avx512(result + cc, acc_lo, acc_hi, prod_lo, prod_hi);
+  }
+  multiply_poly_acum_scalar(ct_ptr + cc, pt_ptr + cc, size - cc, result + cc);
+}
+
+std::vector<std::pair<std::string, utils::MultiplyPolyAcumFn>>
+utils::multiply_poly_acum_variants(int operand_bits) {
+  std::vector<std::pair<std::string, MultiplyPolyAcumFn>> variants;
+  variants.emplace_back("scalar", multiply_poly_acum_scalar);
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    variants.emplace_back("avx2", multiply_poly_acum_avx2);
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    variants.emplace_back("avx512", multiply_poly_acum_avx512);
+    if (__builtin_cpu_supports("avx512ifma") && operand_bits <= 52) {
+      variants.emplace_back("avx512ifma", multiply_poly_acum_avx512ifma);
+    }
+  }
+  return variants;
+}
+
+#else
+
+void utils::multiply_poly_acum_avx2(const uint64_t *, const uint64_t *, size_t, uint128_t *) {
+  throw std::logic_error("multiply_poly_acum_avx2 is only available on x86-64");
+}
+
+void utils::multiply_poly_acum_avx512(const uint64_t *, const uint64_t *, size_t, uint128_t *) {
+  throw std::logic_error("multiply_poly_acum_avx512 is only available on x86-64");
+}
+
+void utils::multiply_poly_acum_avx512ifma(const uint64_t *, const uint64_t *, size_t,
+                                          uint128_t *) {
+  throw std::logic_error("multiply_poly_acum_avx512ifma is only available on x86-64");
+}
+
+std::vector<std::pair<std::string, utils::MultiplyPolyAcumFn>>
+utils::multiply_poly_acum_variants(int operand_bits) {
+  return {{"scalar", multiply_poly_acum_scalar}};
+}
+
+#endif
+
+// Variants are listed from slowest to fastest. The choice is cached per operand
+// width since it is made on every query.
+utils::MultiplyPolyAcumFn utils::multiply_poly_acum_kernel(int operand_bits) {
+  static const auto kernels = []() {
+    std::vector<MultiplyPolyAcumFn> kernels(65);
+    for (int bits = 0; bits <= 64; bits++) {
+      kernels[bits] = multiply_poly_acum_variants(bits).back().second;
+    }
+    return kernels;
+  }();
+  return kernels[std::min(std::max(operand_bits, 0), 64)];
+}
@@ -0,0 +1,63 @@
+#include "workspace.h"
+#include <algorithm>
+#include <atomic>
+
+namespace {
+constexpr size_t WorkspaceAlignment = 64;
+// Bytes in use in the workspaces of all threads, and their peak.
+std::atomic<size_t> total_used{0};
+std::atomic<size_t> total_peak_bytes{0};
+} // namespace
+
+QueryWorkspace &QueryWorkspace::local() {
+  thread_local QueryWorkspace workspace;
+  return workspace;
+}
+
+void QueryWorkspace::reserve(size_t bytes) {
+  if (used_ != 0 || !overflow_.empty() || arena_.size() >= bytes) {
+    return;
+  }
+  // Nothing is in use, so the old contents need not be kept.
+  arena_ = utils::AlignedVector<uint8_t>();
+  arena_.resize(bytes);
+}
+
+uint8_t *QueryWorkspace::allocate_bytes(size_t bytes) {
+  bytes = (bytes + WorkspaceAlignment - 1) / WorkspaceAlignment * WorkspaceAlignment;
+  uint8_t *ptr;
+  if (used_ + bytes <= arena_.size()) {
+    ptr = arena_.data() + used_;
+    used_ += bytes;
+  } else {
+    overflow_.emplace_back(bytes);
+    overflow_bytes_ += bytes;
+    ptr = overflow_.back().data();
+  }
+  peak_ = std::max(peak_, used_ + overflow_bytes_);
+  size_t total = total_used.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  size_t total_peak = total_peak_bytes.load(std::memory_order_relaxed);
+  while (total > total_peak &&
+         !total_peak_bytes.compare_exchange_weak(total_peak, total, std::memory_order_relaxed)) {
+  }
+  return ptr;
+}
+
+// Heap buffers stay in use until the outermost scope ends, as they are only
+// freed then.
+void QueryWorkspace::release(size_t mark) {
+  bool outermost = --depth_ == 0;
+  total_used.fetch_sub(used_ - mark + (outermost ? overflow_bytes_ : 0),
+                       std::memory_order_relaxed);
+  used_ = mark;
+  if (!outermost) {
+    return;
+  }
+  overflow_.clear();
+  overflow_bytes_ = 0;
+  reserve(peak_);
+}
+
+size_t QueryWorkspace::total_peak() { return total_peak_bytes.load(); }
+
+void QueryWorkspace::reset_total_peak() { total_peak_bytes.store(total_used.load()); }